@@ -0,0 +1,32 @@
+// libFuzzer harness for the rendering core: escapes the input as text, raw
+// markup, a child and an attribute, extracts its text, and checks the sizes
+// against the bounds callers reserve. Build with -DFASTTAG_FUZZ=ON.
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "core.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    const char* input = (const char*)data;
+    int indent = size > 0 ? data[0] % 8 : 0;
+    char* out = malloc(FT_TEXT_MAX(size, 8) + FT_ATTR_VALUE_MAX(size) + 16);
+    if (!out) {
+        return 0;
+    }
+    if (ft_write_text(out, input, size, indent) > FT_TEXT_MAX(size, indent) ||
+        ft_write_text(out, input, size, 0) != ft_text_length(input, size) ||
+        ft_write_raw(out, input, size, indent) > FT_RAW_MAX(size, indent) ||
+        ft_write_attr_value(out, input, size) != ft_attr_value_length(input, size)) {
+        abort();
+    }
+    ft_child child = {FT_CHILD_TEXT, input, size, 0, 0};
+    if (ft_write_child(out, &child, 2, indent, 0) > ft_child_max(&child, indent)) {
+        abort();
+    }
+    ft_attr attr = {input, size, FT_ATTR_STRING, input, size, 0, 0};
+    if (ft_write_attr(out, &attr) > ft_attr_max(&attr) || ft_extract_text(out, input, size) > size) {
+        abort();
+    }
+    free(out);
+    return 0;
+}
@@ -0,0 +1,169 @@
+// Tests for the rendering core, without Python. Run with ctest.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core.h"
+
+static int failures = 0;
+
+static void assert_equal(const char* name, const char* data, size_t size, const char* expected) {
+    if (size != strlen(expected) || memcmp(data, expected, size) != 0) {
+        printf("%s: got '%.*s', expected '%s'\n", name, (int)size, data, expected);
+        failures++;
+    }
+}
+
+// Renders an element with ft_append_element and compares it with the markup
+static void check_element(const char* name, const char* tag, const ft_child* children, size_t num_children,
+                          int indent, const char* expected) {
+    ft_tag element = {tag, NULL, 0};
+    ft_buffer buffer = FT_BUFFER_INIT;
+    if (ft_append_element(&buffer, &element, children, num_children, indent) < 0) {
+        printf("%s: out of memory\n", name);
+        failures++;
+    } else {
+        assert_equal(name, buffer.data, buffer.size, expected);
+    }
+    ft_buffer_free(&buffer);
+}
+
+#define WRITE(name, call, expected)                 \
+    do {                                            \
+        char out[256];                              \
+        size_t size = call;                         \
+        assert_equal(name, out, size, expected);    \
+    } while (0)
+
+int main(void) {
+    WRITE("text", ft_write_text(out, "a < b & c", 9, 0), "a &lt; b &amp; c");
+    WRITE("text indent", ft_write_text(out, "a\nb", 3, 2), "a\n  b");
+    WRITE("raw", ft_write_raw(out, "<b>\n</b>", 8, 2), "<b>\n  </b>");
+    WRITE("raw no indent", ft_write_raw(out, "<b>\n</b>", 8, -1), "<b>\n</b>");
+    WRITE("attr value", ft_write_attr_value(out, "Tom & \"Jerry\"", 13), "Tom &amp; &quot;Jerry&quot;");
+    WRITE("attr name", ft_write_attr_name(out, "hx_get", 6), "hx-get");
+    WRITE("attr name _", ft_write_attr_name(out, "_class", 6), "class");
+    WRITE("attr name lone _", ft_write_attr_name(out, "_", 1), "_");
+    WRITE("long", ft_write_long(out, -1234567890123LL), "-1234567890123");
+    WRITE("long min", ft_write_long(out, -9223372036854775807LL - 1), "-9223372036854775808");
+    WRITE("long zero", ft_write_long(out, 0), "0");
+    WRITE("double", ft_write_double(out, 3.25), "3.25");
+
+    if (ft_text_length("a < b & c", 9) != 16 || ft_attr_value_length("\"&", 2) != 11) {
+        printf("escaped lengths\n");
+        failures++;
+    }
+    if (!ft_is_ascii("<p>plain ascii text</p>", 23) || ft_is_ascii("<p>caf\xc3\xa9 au lait</p>", 20) ||
+        ft_is_ascii("12345678\x80", 9) || !ft_is_ascii("", 0)) {
+        printf("ft_is_ascii\n");
+        failures++;
+    }
+    if (!ft_is_self_closing("br") || !ft_is_self_closing("input") || ft_is_self_closing("div")) {
+        printf("ft_is_self_closing\n");
+        failures++;
+    }
+
+    ft_attr attrs[] = {
+        {"_class", 6, FT_ATTR_STRING, "btn \"primary\"", 13, 0, 0},
+        {"hx_swap", 7, FT_ATTR_STRING, "outerHTML", 9, 0, 0},
+        {"width", 5, FT_ATTR_LONG, NULL, 0, 100, 0},
+        {"value", 5, FT_ATTR_DOUBLE, NULL, 0, 0, 1.5},
+        {"disabled", 8, FT_ATTR_TRUE, NULL, 0, 0, 0},
+        {"hidden", 6, FT_ATTR_FALSE, NULL, 0, 0, 0},
+    };
+    ft_tag button = {"button", attrs, sizeof(attrs) / sizeof(attrs[0])};
+    ft_buffer buffer = FT_BUFFER_INIT;
+    if (ft_open_tag(&buffer, &button) < 0 || ft_append_text(&buffer, "Click & go", 10, 2) < 0 ||
+        ft_close_tag(&buffer, "button") < 0) {
+        printf("out of memory\n");
+        return 1;
+    }
+    assert_equal("tag", buffer.data, buffer.size,
+                 "<button class=\"btn &quot;primary&quot;\" hx-swap=\"outerHTML\" width=\"100\" value=\"1.5\" "
+                 "disabled>Click &amp; go</button>");
+    ft_buffer_free(&buffer);
+
+    ft_tag br = {"br", NULL, 0};
+    if (ft_open_tag(&buffer, &br) < 0 || ft_close_tag(&buffer, "br") < 0) {
+        printf("out of memory\n");
+        return 1;
+    }
+    assert_equal("void tag", buffer.data, buffer.size, "<br>");
+    ft_buffer_free(&buffer);
+
+    // Child layout, as rendered by the Python tag functions
+    const ft_child mixed[] = {
+        {FT_CHILD_TEXT, "a & b", 5, 0, 0},
+        {FT_CHILD_RAW, "<span>x</span>", 14, 0, 0},
+        {FT_CHILD_LONG, NULL, 0, 7, 0},
+        {FT_CHILD_DOUBLE, NULL, 0, 0, 2.5},
+    };
+    // Div("a & b", Span("x"), 7, 2.5)
+    check_element("element", "div", mixed, 4, 2, "<div>\n  a &amp; b\n  <span>x</span>\n  7\n  2.5\n</div>");
+    check_element("element indent -1", "div", mixed, 4, -1, "<div>a &amp; b<span>x</span> 7 2.5</div>");
+    // Div(Ul(Li("a")), "x\ny")
+    const ft_child nested[] = {
+        {FT_CHILD_RAW, "<ul>\n  <li>a</li>\n</ul>", 23, 0, 0},
+        {FT_CHILD_TEXT, "x\ny", 3, 0, 0},
+    };
+    check_element("nested", "div", nested, 2, 2, "<div>\n  <ul>\n    <li>a</li>\n  </ul>\n  x\n  y\n</div>");
+    // Div("x\ny"), Div(3) and Td(): a single child stays inline without a newline in it
+    check_element("multi-line child", "div", &nested[1], 1, 2, "<div>\n  x\n  y\n</div>");
+    check_element("single child", "div", &mixed[2], 1, 2, "<div>7</div>");
+    check_element("no children", "td", NULL, 0, 2, "<td></td>");
+    // Pre("a\nb", 1) and Pre("a", "b", "c")
+    const ft_child pre[] = {
+        {FT_CHILD_TEXT, "a\nb", 3, 0, 0},
+        {FT_CHILD_LONG, NULL, 0, 1, 0},
+    };
+    check_element("pre", "pre", pre, 2, 2, "<pre>a\nb1</pre>");
+    const ft_child letters[] = {
+        {FT_CHILD_TEXT, "a", 1, 0, 0},
+        {FT_CHILD_TEXT, "b", 1, 0, 0},
+        {FT_CHILD_TEXT, "c", 1, 0, 0},
+    };
+    check_element("pre indent -1", "pre", letters, 3, -1, "<pre>ab c</pre>");
+    check_element("void", "br", letters, 1, 2, "<br>a");
+
+    const int64_t ids[] = {1, -20};
+    const double prices[] = {1.5, 1e300};
+    const int32_t offsets[] = {0, 5, 8};
+    ft_column columns[] = {
+        {FT_COLUMN_INT64, ids, 0, NULL, 0},
+        {FT_COLUMN_FLOAT64, prices, 0, NULL, 0},
+        {FT_COLUMN_STRING, "a & b<x>", 8, offsets, 4},
+    };
+    const char* headers[] = {"id", "price", "name"};
+    const size_t header_lengths[] = {2, 5, 4};
+    ft_table table = {columns, 3, 2, headers, header_lengths};
+    char table_out[512];
+    size_t table_max = ft_table_max(&table, -1);
+    size_t table_size = ft_write_table(table_out, &table, -1);
+    assert_equal("table", table_out, table_size,
+                 "<table><thead><tr><th>id</th><th>price</th><th>name</th></tr></thead><tbody>"
+                 "<tr><td>1</td><td>1.5</td><td>a &amp; b</td></tr>"
+                 "<tr><td>-20</td><td>1e+300</td><td>&lt;x></td></tr></tbody></table>");
+    if (table_size > table_max || ft_write_table(table_out, &table, 2) > ft_table_max(&table, 2)) {
+        printf("ft_table_max\n");
+        failures++;
+    }
+    const int32_t bad_offsets[] = {0, 9, 8};
+    columns[2].offsets = bad_offsets;
+    if (ft_table_max(&table, -1) != (size_t)-1) {
+        printf("ft_table_max bad offsets\n");
+        failures++;
+    }
+
+    const char* page = "<html><head><title>A &amp; B</title><script>if (a < b) {}</script></head>"
+                       "<body><p title=\"x > y\">Hello <b>wo</b>rld</p><!-- note --><p>caf&#233;&nbsp;&#x263A;</p>"
+                       "\n  <ul><li>1 &lt; 2</li><li>&bogus;</li></ul></body></html>";
+    char text_out[512];
+    assert_equal("text extraction", text_out, ft_extract_text(text_out, page, strlen(page)),
+                 "A & B Hello world caf\xc3\xa9 \xe2\x98\xba 1 < 2 &bogus;");
+
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
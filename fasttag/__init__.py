@@ -0,0 +1,13 @@
+from . import _fasttag
+from ._fasttag import *
+from ._fasttag import HTML, DOCTYPE
+from .hoist import static_hoist
+
+
+def get_include():
+    """Directory of capi.h, for building extensions that use the C API."""
+    import os
+    return os.path.dirname(__file__)
+
+
+__all__ = [name for name in dir(_fasttag) if not name.startswith("_")] + ["static_hoist", "get_include"]
@@ -0,0 +1,82 @@
+// C API of the fasttag module, for other extensions (Cython helpers, C
+// request handlers) to render at C call cost, without packing arguments into
+// tuples and dicts or looking up the tag functions on the module.
+//
+// Build against it with fasttag.get_include() on the include path, then:
+//
+//   #include "capi.h"
+//
+//   // once, in the module's exec function or PyInit
+//   if (FastTag_IMPORT() < 0) {
+//       return NULL;
+//   }
+//
+//   ft_attr attrs[] = {{"_class", 6, FT_ATTR_STRING, "num", 3, 0, 0}};
+//   ft_tag td = {"td", attrs, 1};
+//   PyObject* children[] = {value};
+//   PyObject* cell = FastTag_RenderTag(&td, children, 1);
+//
+// The API belongs to the fasttag module of the interpreter that imported it.
+#ifndef FASTTAG_CAPI_H
+#define FASTTAG_CAPI_H
+
+#include <Python.h>
+
+#include "core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FASTTAG_CAPI_NAME "fasttag._fasttag._C_API"
+// Bumped when entries are added; existing entries keep their meaning.
+#define FASTTAG_CAPI_VERSION 1
+
+typedef struct fasttag_CAPI fasttag_CAPI;
+
+struct fasttag_CAPI {
+    int version;
+    // Renders an element like Tag(*children, **attrs) at the module's current
+    // indentation. Returns a new HTML, or NULL with an exception set.
+    PyObject* (*render_tag)(fasttag_CAPI* api, const ft_tag* tag, PyObject* const* children,
+                            Py_ssize_t num_children);
+    // New HTML with a copy of size bytes of markup.
+    PyObject* (*html_from_string)(fasttag_CAPI* api, const char* data, Py_ssize_t size);
+    // Appends size bytes of UTF-8 text, escaped, to the HTML in *html, like
+    // PyUnicode_Append: *html is replaced by the result, or set to NULL on
+    // error. An HTML only referenced by the caller is grown in place.
+    int (*append_text)(fasttag_CAPI* api, PyObject** html, const char* data, Py_ssize_t size);
+    // The markup of an HTML object, valid while it's alive, or NULL with
+    // TypeError if obj isn't one.
+    const char* (*html_data)(fasttag_CAPI* api, PyObject* obj, Py_ssize_t* size);
+};
+
+// The module itself defines FASTTAG_MODULE and only needs the struct.
+#ifndef FASTTAG_MODULE
+static fasttag_CAPI* FastTag_API = NULL;
+
+static inline int FastTag_IMPORT(void) {
+    FastTag_API = (fasttag_CAPI*)PyCapsule_Import(FASTTAG_CAPI_NAME, 0);
+    if (!FastTag_API) {
+        return -1;
+    }
+    if (FastTag_API->version < FASTTAG_CAPI_VERSION) {
+        PyErr_SetString(PyExc_ImportError, "fasttag is older than the C API header");
+        FastTag_API = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+#define FastTag_RenderTag(tag, children, num_children) \
+    FastTag_API->render_tag(FastTag_API, (tag), (children), (num_children))
+#define FastTag_FromStringAndSize(data, size) FastTag_API->html_from_string(FastTag_API, (data), (size))
+#define FastTag_AppendText(html, data, size) FastTag_API->append_text(FastTag_API, (html), (data), (size))
+#define FastTag_Data(obj, size) FastTag_API->html_data(FastTag_API, (obj), (size))
+#endif  // FASTTAG_MODULE
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // FASTTAG_CAPI_H
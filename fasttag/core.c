@@ -0,0 +1,736 @@
+#include "core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t ft_write_text(char* out, const char* data, size_t length, int indent) {
+    char* start = out;
+    for (size_t j = 0; j < length; j++) {
+        if (data[j] == '<') {
+            memcpy(out, "&lt;", 4);
+            out += 4;
+        } else if (data[j] == '&') {
+            memcpy(out, "&amp;", 5);
+            out += 5;
+        } else if (data[j] == '\n' && indent > 0) {
+            *out++ = '\n';
+            memset(out, ' ', indent);
+            out += indent;
+        } else {
+            *out++ = data[j];
+        }
+    }
+    return out - start;
+}
+
+size_t ft_write_raw(char* out, const char* data, size_t length, int indent) {
+    if (indent <= 0) {
+        memcpy(out, data, length);
+        return length;
+    }
+    char* start = out;
+    const char* end = data + length;
+    while (data < end) {
+        const char* newline = memchr(data, '\n', end - data);
+        if (!newline) {
+            memcpy(out, data, end - data);
+            out += end - data;
+            break;
+        }
+        memcpy(out, data, newline + 1 - data);
+        out += newline + 1 - data;
+        memset(out, ' ', indent);
+        out += indent;
+        data = newline + 1;
+    }
+    return out - start;
+}
+
+size_t ft_write_attr_value(char* out, const char* data, size_t length) {
+    char* start = out;
+    for (size_t j = 0; j < length; j++) {
+        if (data[j] == '&') {
+            memcpy(out, "&amp;", 5);
+            out += 5;
+        } else if (data[j] == '"') {
+            memcpy(out, "&quot;", 6);
+            out += 6;
+        } else {
+            *out++ = data[j];
+        }
+    }
+    return out - start;
+}
+
+size_t ft_write_attr_name(char* out, const char* name, size_t length) {
+    if (length > 0 && name[0] == '_') {
+        // A lone _ is kept
+        size_t skip = length > 1 ? 1 : 0;
+        memcpy(out, name + skip, length - skip);
+        return length - skip;
+    }
+    for (size_t j = 0; j < length; j++) {
+        out[j] = name[j] == '_' ? '-' : name[j];
+    }
+    return length;
+}
+
+size_t ft_write_long(char* out, long long value) {
+    // Digits from the end, as unsigned so that LLONG_MIN works too
+    char digits[FT_NUMBER_MAX];
+    char* end = digits + sizeof(digits);
+    char* p = end;
+    unsigned long long magnitude = value < 0 ? 0 - (unsigned long long)value : (unsigned long long)value;
+    do {
+        *--p = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) {
+        *--p = '-';
+    }
+    memcpy(out, p, end - p);
+    return end - p;
+}
+
+size_t ft_write_double(char* out, double value) {
+    return snprintf(out, FT_NUMBER_MAX, "%g", value);
+}
+
+size_t ft_text_length(const char* data, size_t length) {
+    size_t result = length;
+    for (size_t j = 0; j < length; j++) {
+        if (data[j] == '<') {
+            result += 3;
+        } else if (data[j] == '&') {
+            result += 4;
+        }
+    }
+    return result;
+}
+
+size_t ft_attr_value_length(const char* data, size_t length) {
+    size_t result = length;
+    for (size_t j = 0; j < length; j++) {
+        if (data[j] == '&') {
+            result += 4;
+        } else if (data[j] == '"') {
+            result += 5;
+        }
+    }
+    return result;
+}
+
+int ft_is_ascii(const char* data, size_t length) {
+    // A word at a time, memcpy'd because data needn't be aligned
+    const uint64_t high_bits = 0x8080808080808080ULL;
+    size_t j = 0;
+    for (; j + 8 <= length; j += 8) {
+        uint64_t word;
+        memcpy(&word, data + j, 8);
+        if (word & high_bits) {
+            return 0;
+        }
+    }
+    for (; j < length; j++) {
+        if ((unsigned char)data[j] & 0x80) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int ft_is_self_closing(const char *tag) {
+    if (tag == NULL || tag[0] == '\0') return 0;
+
+    switch (tag[0]) {
+        case 'a':
+            if (strcmp(tag, "area") == 0) return 1;
+            break;
+        case 'b':
+            if (strcmp(tag, "base") == 0 || strcmp(tag, "br") == 0) return 1;
+            break;
+        case 'c':
+            if (strcmp(tag, "col") == 0) return 1;
+            break;
+        case 'e':
+            if (strcmp(tag, "embed") == 0) return 1;
+            break;
+        case 'h':
+            if (strcmp(tag, "hr") == 0) return 1;
+            break;
+        case 'i':
+            if (strcmp(tag, "img") == 0 || strcmp(tag, "input") == 0) return 1;
+            break;
+        case 'l':
+            if (strcmp(tag, "link") == 0) return 1;
+            break;
+        case 'm':
+            if (strcmp(tag, "meta") == 0) return 1;
+            break;
+        case 's':
+            if (strcmp(tag, "source") == 0) return 1;
+            break;
+        case 't':
+            if (strcmp(tag, "track") == 0) return 1;
+            break;
+        case 'w':
+            if (strcmp(tag, "wbr") == 0) return 1;
+            break;
+    }
+    return 0;
+}
+
+size_t ft_attr_max(const ft_attr* attr) {
+    // Space, =, and quotes
+    size_t result = attr->name_length + 4;
+    if (attr->kind == FT_ATTR_STRING) {
+        result += FT_ATTR_VALUE_MAX(attr->string_length);
+    } else if (attr->kind == FT_ATTR_LONG || attr->kind == FT_ATTR_DOUBLE) {
+        result += FT_NUMBER_MAX;
+    }
+    return result;
+}
+
+size_t ft_write_attr(char* out, const ft_attr* attr) {
+    if (attr->kind == FT_ATTR_FALSE) {
+        return 0;
+    }
+    char* start = out;
+    *out++ = ' ';
+    out += ft_write_attr_name(out, attr->name, attr->name_length);
+    if (attr->kind == FT_ATTR_TRUE) {
+        return out - start;
+    }
+    *out++ = '=';
+    *out++ = '"';
+    if (attr->kind == FT_ATTR_STRING) {
+        out += ft_write_attr_value(out, attr->string, attr->string_length);
+    } else if (attr->kind == FT_ATTR_LONG) {
+        out += ft_write_long(out, attr->long_value);
+    } else {
+        out += ft_write_double(out, attr->double_value);
+    }
+    *out++ = '"';
+    return out - start;
+}
+
+int ft_buffer_reserve(ft_buffer* buffer, size_t extra) {
+    if (extra <= buffer->capacity - buffer->size) {
+        return 0;
+    }
+    if (extra > (size_t)-1 / 2 - buffer->size) {
+        return -1;
+    }
+    size_t capacity = 2 * (buffer->size + extra);
+    char* data = realloc(buffer->data, capacity);
+    if (!data) {
+        return -1;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+void ft_buffer_free(ft_buffer* buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = buffer->capacity = 0;
+}
+
+int ft_append_text(ft_buffer* buffer, const char* data, size_t length, int indent) {
+    if (ft_buffer_reserve(buffer, FT_TEXT_MAX(length, indent)) < 0) {
+        return -1;
+    }
+    buffer->size += ft_write_text(buffer->data + buffer->size, data, length, indent);
+    return 0;
+}
+
+int ft_append_raw(ft_buffer* buffer, const char* data, size_t length, int indent) {
+    if (ft_buffer_reserve(buffer, FT_RAW_MAX(length, indent)) < 0) {
+        return -1;
+    }
+    buffer->size += ft_write_raw(buffer->data + buffer->size, data, length, indent);
+    return 0;
+}
+
+int ft_open_tag(ft_buffer* buffer, const ft_tag* tag) {
+    size_t name_length = strlen(tag->name);
+    if (ft_buffer_reserve(buffer, name_length + 2) < 0) {
+        return -1;
+    }
+    buffer->data[buffer->size++] = '<';
+    memcpy(buffer->data + buffer->size, tag->name, name_length);
+    buffer->size += name_length;
+    for (size_t i = 0; i < tag->num_attrs; i++) {
+        if (ft_buffer_reserve(buffer, ft_attr_max(&tag->attrs[i]) + 1) < 0) {
+            return -1;
+        }
+        buffer->size += ft_write_attr(buffer->data + buffer->size, &tag->attrs[i]);
+    }
+    buffer->data[buffer->size++] = '>';
+    return 0;
+}
+
+int ft_close_tag(ft_buffer* buffer, const char* name) {
+    if (ft_is_self_closing(name)) {
+        return 0;
+    }
+    size_t name_length = strlen(name);
+    if (ft_buffer_reserve(buffer, name_length + 3) < 0) {
+        return -1;
+    }
+    memcpy(buffer->data + buffer->size, "</", 2);
+    memcpy(buffer->data + buffer->size + 2, name, name_length);
+    buffer->data[buffer->size + 2 + name_length] = '>';
+    buffer->size += name_length + 3;
+    return 0;
+}
+
+int ft_children_inline(const char* tag, size_t num_children, const ft_child* only_child) {
+    if (num_children == 0 || !strcmp(tag, "pre")) {
+        return 1;
+    }
+    if (num_children > 1) {
+        return 0;
+    }
+    if (!only_child || only_child->kind == FT_CHILD_LONG || only_child->kind == FT_CHILD_DOUBLE) {
+        return 1;
+    }
+    return only_child->kind == FT_CHILD_TEXT && !memchr(only_child->data, '\n', only_child->length);
+}
+
+size_t ft_child_max(const ft_child* child, int indent) {
+    // Newline and indentation, or a space
+    size_t result = 1 + (indent > 0 ? (size_t)indent : 0);
+    if (child->kind == FT_CHILD_TEXT) {
+        return result + FT_TEXT_MAX(child->length, indent);
+    }
+    if (child->kind == FT_CHILD_RAW) {
+        return result + FT_RAW_MAX(child->length, indent);
+    }
+    return result + FT_NUMBER_MAX;
+}
+
+size_t ft_write_child_indent(char* out, int indent, int children_inline) {
+    if (indent < 0 || children_inline) {
+        return 0;
+    }
+    out[0] = '\n';
+    memset(out + 1, ' ', indent);
+    return 1 + indent;
+}
+
+size_t ft_write_child_value(char* out, const ft_child* child, size_t index, int indent, int children_inline) {
+    if (child->kind == FT_CHILD_RAW) {
+        return ft_write_raw(out, child->data, child->length, indent);
+    }
+    size_t space = indent < 0 && index > 1;
+    if (space) {
+        out[0] = ' ';
+    }
+    if (child->kind == FT_CHILD_TEXT) {
+        return space + ft_write_text(out + space, child->data, child->length, children_inline ? 0 : indent);
+    }
+    if (child->kind == FT_CHILD_LONG) {
+        return space + ft_write_long(out + space, child->long_value);
+    }
+    return space + ft_write_double(out + space, child->double_value);
+}
+
+size_t ft_write_child(char* out, const ft_child* child, size_t index, int indent, int children_inline) {
+    size_t length = ft_write_child_indent(out, indent, children_inline);
+    return length + ft_write_child_value(out + length, child, index, indent, children_inline);
+}
+
+size_t ft_write_children_end(char* out, int indent, int children_inline) {
+    if (indent < 0 || children_inline) {
+        return 0;
+    }
+    out[0] = '\n';
+    return 1;
+}
+
+int ft_append_element(ft_buffer* buffer, const ft_tag* tag, const ft_child* children, size_t num_children, int indent) {
+    if (ft_open_tag(buffer, tag) < 0) {
+        return -1;
+    }
+    int children_inline = ft_children_inline(tag->name, num_children, num_children == 1 ? children : NULL);
+    for (size_t i = 0; i < num_children; i++) {
+        if (ft_buffer_reserve(buffer, ft_child_max(&children[i], indent)) < 0) {
+            return -1;
+        }
+        buffer->size += ft_write_child(buffer->data + buffer->size, &children[i], i, indent, children_inline);
+    }
+    if (ft_is_self_closing(tag->name)) {
+        return 0;
+    }
+    if (ft_buffer_reserve(buffer, 1) < 0) {
+        return -1;
+    }
+    buffer->size += ft_write_children_end(buffer->data + buffer->size, indent, children_inline);
+    return ft_close_tag(buffer, tag->name);
+}
+
+// Longest %g output, like -1.23457e+308
+#define DOUBLE_MAX 16
+#define NEWLINE_LENGTH(indent, level) ((indent) >= 0 ? 1 + (size_t)(indent) * (level) : 0)
+
+static char* write_newline(char* out, int indent, int level) {
+    if (indent >= 0) {
+        *out++ = '\n';
+        memset(out, ' ', (size_t)indent * level);
+        out += (size_t)indent * level;
+    }
+    return out;
+}
+
+static size_t string_offset(const ft_column* column, size_t row) {
+    if (column->offset_size == 4) {
+        return (size_t)((const int32_t*)column->offsets)[row];
+    }
+    return (size_t)((const int64_t*)column->offsets)[row];
+}
+
+static size_t long_length(int64_t value) {
+    // The magnitude as unsigned, which also holds INT64_MIN
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    size_t length = value < 0 ? 2 : 1;
+    while (magnitude >= 10) {
+        magnitude /= 10;
+        length++;
+    }
+    return length;
+}
+
+size_t ft_table_max(const ft_table* table, int indent) {
+    size_t cell = NEWLINE_LENGTH(indent, 3) + 9;  // <td></td>
+    size_t result = 15 + NEWLINE_LENGTH(indent, 0);  // <table></table>
+    if (table->headers) {
+        // <thead><tr>...</tr></thead>
+        result += 2 * NEWLINE_LENGTH(indent, 1) + 2 * NEWLINE_LENGTH(indent, 2) + 24;
+        for (size_t c = 0; c < table->num_columns; c++) {
+            result += cell + ft_text_length(table->headers[c], table->header_lengths[c]);
+        }
+    }
+    result += NEWLINE_LENGTH(indent, 1) + 15;  // <tbody></tbody>
+    if (table->num_rows > 0) {
+        result += NEWLINE_LENGTH(indent, 1);
+        result += table->num_rows * (2 * NEWLINE_LENGTH(indent, 2) + 9 + table->num_columns * cell);
+    }
+    for (size_t c = 0; c < table->num_columns; c++) {
+        const ft_column* column = &table->columns[c];
+        if (column->kind == FT_COLUMN_INT64) {
+            const int64_t* values = column->values;
+            for (size_t r = 0; r < table->num_rows; r++) {
+                result += long_length(values[r]);
+            }
+        } else if (column->kind == FT_COLUMN_FLOAT64) {
+            result += table->num_rows * DOUBLE_MAX;
+        } else if (column->kind == FT_COLUMN_BOOL) {
+            result += table->num_rows;
+        } else {
+            size_t start = string_offset(column, 0);
+            for (size_t r = 0; r < table->num_rows; r++) {
+                size_t end = string_offset(column, r + 1);
+                if (start > end || end > column->data_length) {
+                    return (size_t)-1;
+                }
+                result += ft_text_length((const char*)column->values + start, end - start);
+                start = end;
+            }
+        }
+    }
+    return result;
+}
+
+static char* write_cell_value(char* out, const ft_column* column, size_t row) {
+    if (column->kind == FT_COLUMN_INT64) {
+        return out + ft_write_long(out, ((const int64_t*)column->values)[row]);
+    } else if (column->kind == FT_COLUMN_FLOAT64) {
+        return out + ft_write_double(out, ((const double*)column->values)[row]);
+    } else if (column->kind == FT_COLUMN_BOOL) {
+        *out++ = ((const char*)column->values)[row] ? '1' : '0';
+        return out;
+    }
+    size_t start = string_offset(column, row);
+    size_t end = string_offset(column, row + 1);
+    return out + ft_write_text(out, (const char*)column->values + start, end - start, 0);
+}
+
+size_t ft_write_table(char* out, const ft_table* table, int indent) {
+    char* start = out;
+    memcpy(out, "<table>", 7);
+    out += 7;
+    if (table->headers) {
+        out = write_newline(out, indent, 1);
+        memcpy(out, "<thead>", 7);
+        out = write_newline(out + 7, indent, 2);
+        memcpy(out, "<tr>", 4);
+        out += 4;
+        for (size_t c = 0; c < table->num_columns; c++) {
+            out = write_newline(out, indent, 3);
+            memcpy(out, "<th>", 4);
+            out += 4;
+            out += ft_write_text(out, table->headers[c], table->header_lengths[c], 0);
+            memcpy(out, "</th>", 5);
+            out += 5;
+        }
+        out = write_newline(out, indent, 2);
+        memcpy(out, "</tr>", 5);
+        out = write_newline(out + 5, indent, 1);
+        memcpy(out, "</thead>", 8);
+        out += 8;
+    }
+    out = write_newline(out, indent, 1);
+    memcpy(out, "<tbody>", 7);
+    out += 7;
+    for (size_t r = 0; r < table->num_rows; r++) {
+        out = write_newline(out, indent, 2);
+        memcpy(out, "<tr>", 4);
+        out += 4;
+        for (size_t c = 0; c < table->num_columns; c++) {
+            out = write_newline(out, indent, 3);
+            memcpy(out, "<td>", 4);
+            out = write_cell_value(out + 4, &table->columns[c], r);
+            memcpy(out, "</td>", 5);
+            out += 5;
+        }
+        out = write_newline(out, indent, 2);
+        memcpy(out, "</tr>", 5);
+        out += 5;
+    }
+    if (table->num_rows > 0) {
+        out = write_newline(out, indent, 1);
+    }
+    memcpy(out, "</tbody>", 8);
+    out = write_newline(out + 8, indent, 0);
+    memcpy(out, "</table>", 8);
+    out += 8;
+    return out - start;
+}
+
+// Characters that end a run of plain text in ft_extract_text
+#define TEXT_SPECIAL 1
+#define TEXT_SPACE 2
+
+static const unsigned char text_class[256] = {
+    ['\t'] = TEXT_SPECIAL | TEXT_SPACE,
+    ['\n'] = TEXT_SPECIAL | TEXT_SPACE,
+    ['\f'] = TEXT_SPECIAL | TEXT_SPACE,
+    ['\r'] = TEXT_SPECIAL | TEXT_SPACE,
+    [' '] = TEXT_SPECIAL | TEXT_SPACE,
+    ['&'] = TEXT_SPECIAL,
+    ['<'] = TEXT_SPECIAL,
+};
+
+static int is_name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+}
+
+static int name_equals(const char* name, size_t length, const char* lower) {
+    for (size_t i = 0; i < length; i++) {
+        char c = name[i] >= 'A' && name[i] <= 'Z' ? name[i] + 32 : name[i];
+        if (c != lower[i]) {
+            return 0;
+        }
+    }
+    return lower[length] == '\0';
+}
+
+// Phrasing elements, whose tags don't separate words
+static int is_inline_tag(const char* name, size_t length) {
+    static const char* const tags[] = {
+        "a", "abbr", "b", "bdi", "bdo", "cite", "code", "data", "del", "dfn", "em", "font", "i", "ins", "kbd",
+        "mark", "q", "s", "samp", "small", "span", "strike", "strong", "sub", "sup", "time", "tt", "u", "var",
+    };
+    for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+        if (name_equals(name, length, tags[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Skips the markup starting at p, which is at a '<'. Sets *separates if it
+// ends a word. Returns p unchanged if the '<' is just text.
+static const char* skip_markup(const char* p, const char* end, int* separates) {
+    const char* q = p + 1;
+    *separates = 1;
+    if (end - q >= 3 && memcmp(q, "!--", 3) == 0) {
+        *separates = 0;
+        for (q += 3; end - q >= 3; q++) {
+            if (memcmp(q, "-->", 3) == 0) {
+                return q + 3;
+            }
+        }
+        return end;
+    }
+    char closing = q < end && *q == '/';
+    q += closing;
+    const char* name = q;
+    while (q < end && is_name_char(*q)) {
+        q++;
+    }
+    size_t name_length = q - name;
+    if (name_length == 0 && !(p + 1 < end && (p[1] == '!' || p[1] == '?')) && !closing) {
+        return p;
+    }
+    // To the end of the tag, over quoted attribute values that may contain >
+    char quote = 0;
+    while (q < end && (quote || *q != '>')) {
+        if (quote ? *q == quote : (*q == '"' || *q == '\'')) {
+            quote = quote ? 0 : *q;
+        }
+        q++;
+    }
+    if (q == end) {
+        return end;
+    }
+    q++;
+    *separates = !is_inline_tag(name, name_length);
+    if (!closing && (name_equals(name, name_length, "script") || name_equals(name, name_length, "style"))) {
+        // Contents end at the first </script or </style
+        while ((q = memchr(q, '<', end - q))) {
+            if ((size_t)(end - q) > name_length + 1 && q[1] == '/' && name_equals(q + 2, name_length, name_length == 6 ? "script" : "style")) {
+                return skip_markup(q, end, separates);
+            }
+            q++;
+        }
+        return end;
+    }
+    return q;
+}
+
+static size_t write_utf8(char* out, unsigned long code) {
+    if (code == 0 || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF)) {
+        code = 0xFFFD;
+    }
+    if (code < 0x80) {
+        out[0] = (char)code;
+        return 1;
+    } else if (code < 0x800) {
+        out[0] = (char)(0xC0 | (code >> 6));
+        out[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    } else if (code < 0x10000) {
+        out[0] = (char)(0xE0 | (code >> 12));
+        out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (code >> 18));
+    out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+// Decodes the entity at p, which is at a '&', into out (at most 4 bytes, and
+// never more than the entity's own length). Returns the length of the entity,
+// 0 if it isn't one, or sets *space for &nbsp;.
+static size_t decode_entity(const char* p, const char* end, char* out, size_t* written, int* space) {
+    const char* semicolon = memchr(p, ';', end - p < 12 ? end - p : 12);
+    *space = 0;
+    if (!semicolon) {
+        return 0;
+    }
+    const char* name = p + 1;
+    size_t length = semicolon - name;
+    if (length >= 2 && name[0] == '#') {
+        int hex = name[1] == 'x' || name[1] == 'X';
+        unsigned long code = 0;
+        for (const char* d = name + 1 + hex; d < semicolon; d++) {
+            int digit = *d >= '0' && *d <= '9' ? *d - '0'
+                      : hex && *d >= 'a' && *d <= 'f' ? *d - 'a' + 10
+                      : hex && *d >= 'A' && *d <= 'F' ? *d - 'A' + 10 : -1;
+            if (digit < 0 || (size_t)(d - name) > 8) {
+                return 0;
+            }
+            code = code * (hex ? 16 : 10) + digit;
+        }
+        if (length == 1u + hex) {
+            return 0;
+        }
+        *written = write_utf8(out, code);
+    } else if (name_equals(name, length, "lt")) {
+        *out = '<';
+        *written = 1;
+    } else if (name_equals(name, length, "gt")) {
+        *out = '>';
+        *written = 1;
+    } else if (name_equals(name, length, "amp")) {
+        *out = '&';
+        *written = 1;
+    } else if (name_equals(name, length, "quot")) {
+        *out = '"';
+        *written = 1;
+    } else if (name_equals(name, length, "apos")) {
+        *out = '\'';
+        *written = 1;
+    } else if (name_equals(name, length, "nbsp")) {
+        *space = 1;
+        *written = 0;
+    } else {
+        return 0;
+    }
+    return semicolon + 1 - p;
+}
+
+size_t ft_extract_text(char* out, const char* data, size_t length) {
+    char* start = out;
+    const char* p = data;
+    const char* end = data + length;
+    int pending_space = 0;
+    while (p < end) {
+        // Plain text is copied in runs
+        const char* run = p;
+        while (p < end && !text_class[(unsigned char)*p]) {
+            p++;
+        }
+        if (p > run) {
+            if (pending_space && out > start) {
+                *out++ = ' ';
+            }
+            pending_space = 0;
+            memcpy(out, run, p - run);
+            out += p - run;
+            continue;
+        }
+        if (text_class[(unsigned char)*p] & TEXT_SPACE) {
+            pending_space = 1;
+            p++;
+            continue;
+        }
+        if (*p == '<') {
+            int separates;
+            const char* next = skip_markup(p, end, &separates);
+            if (next != p) {
+                pending_space |= separates;
+                p = next;
+                continue;
+            }
+        }
+        char decoded[4];
+        size_t written = 1;
+        int space = 0;
+        size_t entity = *p == '&' ? decode_entity(p, end, decoded, &written, &space) : 0;
+        if (!entity) {
+            decoded[0] = *p;
+            written = 1;
+            entity = 1;
+        }
+        p += entity;
+        if (space) {
+            pending_space = 1;
+            continue;
+        }
+        if (pending_space && out > start) {
+            *out++ = ' ';
+        }
+        pending_space = 0;
+        memcpy(out, decoded, written);
+        out += written;
+    }
+    return out - start;
+}
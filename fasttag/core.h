@@ -0,0 +1,176 @@
+// Rendering core of fasttag: escaping, indentation and tag/attribute markup on
+// plain byte spans, without Python. The Python module is a binding on top of
+// it; C and C++ programs can link it directly (the fasttag_core CMake target)
+// to produce the same markup.
+//
+// The ft_write_* functions write to out, which must have room for the
+// matching *_MAX size, and return the number of bytes written. The ft_buffer
+// functions grow a malloc'd buffer as needed and return -1 if that fails.
+#ifndef FASTTAG_CORE_H
+#define FASTTAG_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Largest output of writing length bytes of text: &amp; is the longest
+// escape, and a newline takes 1 + indent bytes.
+#define FT_TEXT_MAX(length, indent) ((length) * ((indent) >= 4 ? (size_t)(indent) + 1 : 5))
+// Raw markup only grows by the indentation after newlines
+#define FT_RAW_MAX(length, indent) ((length) * ((indent) > 0 ? (size_t)(indent) + 1 : 1))
+// &quot; is the longest escape
+#define FT_ATTR_VALUE_MAX(length) ((length) * 6)
+// Formatted long long or double (%g)
+#define FT_NUMBER_MAX 24
+
+// Text: < and & escaped; if indent > 0, newlines are followed by indent spaces.
+size_t ft_write_text(char* out, const char* data, size_t length, int indent);
+// Markup copied unchanged, except that newlines are followed by indent spaces.
+size_t ft_write_raw(char* out, const char* data, size_t length, int indent);
+// Attribute value: & and " escaped.
+size_t ft_write_attr_value(char* out, const char* data, size_t length);
+// Attribute name from a keyword argument name: a leading _ is dropped and the
+// rest kept unchanged (_class -> class), otherwise _ becomes - (hx_get -> hx-get).
+// Never longer than the name.
+size_t ft_write_attr_name(char* out, const char* name, size_t length);
+size_t ft_write_long(char* out, long long value);
+size_t ft_write_double(char* out, double value);
+
+// Exact sizes of ft_write_text with indent 0 and ft_write_attr_value.
+size_t ft_text_length(const char* data, size_t length);
+size_t ft_attr_value_length(const char* data, size_t length);
+
+// Whether data has no bytes above 0x7f, so that it's the same in UTF-8 and
+// Latin-1 and converts to a string with a plain copy.
+int ft_is_ascii(const char* data, size_t length);
+
+// Void elements (br, img, input...), which have no closing tag.
+int ft_is_self_closing(const char* tag);
+
+typedef enum {
+    FT_ATTR_STRING,  // escaped string
+    FT_ATTR_LONG,
+    FT_ATTR_DOUBLE,
+    FT_ATTR_TRUE,    // name only, like disabled
+    FT_ATTR_FALSE,   // left out
+} ft_attr_kind;
+
+typedef struct {
+    const char* name;  // keyword argument style, converted by ft_write_attr_name
+    size_t name_length;
+    ft_attr_kind kind;
+    const char* string;
+    size_t string_length;
+    long long long_value;
+    double double_value;
+} ft_attr;
+
+typedef struct {
+    const char* name;  // NUL-terminated
+    const ft_attr* attrs;
+    size_t num_attrs;
+} ft_tag;
+
+// Largest output of ft_write_attr, including the leading space.
+size_t ft_attr_max(const ft_attr* attr);
+// Writes " name", " name=\"value\"", or nothing for FT_ATTR_FALSE.
+size_t ft_write_attr(char* out, const ft_attr* attr);
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+} ft_buffer;
+
+#define FT_BUFFER_INIT {NULL, 0, 0}
+
+int ft_buffer_reserve(ft_buffer* buffer, size_t extra);
+void ft_buffer_free(ft_buffer* buffer);
+int ft_append_text(ft_buffer* buffer, const char* data, size_t length, int indent);
+int ft_append_raw(ft_buffer* buffer, const char* data, size_t length, int indent);
+// <name attrs...>
+int ft_open_tag(ft_buffer* buffer, const ft_tag* tag);
+// </name>, nothing for void elements
+int ft_close_tag(ft_buffer* buffer, const char* name);
+
+// Children of an element, laid out like the tag functions do: with indent
+// >= 0 each child goes on its own line, indent spaces in (markup is re-indented
+// by the caller's level as it's nested), unless the children are inline: none,
+// a single one-line text or number, or any inside pre. With indent -1, text
+// and numbers from the third child on are preceded by a space.
+typedef enum {
+    FT_CHILD_TEXT,  // escaped
+    FT_CHILD_RAW,   // markup, like a rendered element
+    FT_CHILD_LONG,
+    FT_CHILD_DOUBLE,
+} ft_child_kind;
+
+typedef struct {
+    ft_child_kind kind;
+    const char* data;
+    size_t length;
+    long long long_value;
+    double double_value;
+} ft_child;
+
+// Whether the children of tag stay on its line. only_child is the child if
+// there is exactly one; NULL counts as a number does.
+int ft_children_inline(const char* tag, size_t num_children, const ft_child* only_child);
+// Largest output of ft_write_child
+size_t ft_child_max(const ft_child* child, int indent);
+// The newline and indentation before a child, nothing for inline children.
+size_t ft_write_child_indent(char* out, int indent, int children_inline);
+// A child without that newline, index being its position among the children.
+size_t ft_write_child_value(char* out, const ft_child* child, size_t index, int indent, int children_inline);
+size_t ft_write_child(char* out, const ft_child* child, size_t index, int indent, int children_inline);
+// The newline before the end tag, nothing for inline children.
+size_t ft_write_children_end(char* out, int indent, int children_inline);
+// <name attrs...>children</name>
+int ft_append_element(ft_buffer* buffer, const ft_tag* tag, const ft_child* children, size_t num_children, int indent);
+
+// Columnar tables: <table> with an optional header row and a <td> per value,
+// laid out like nested Table(Thead(Tr(Th...)), Tbody(Tr(Td...))) calls with
+// the same indent. Newlines in strings aren't re-indented.
+typedef enum {
+    FT_COLUMN_INT64,
+    FT_COLUMN_FLOAT64,
+    FT_COLUMN_BOOL,    // one byte per value, written as 1 or 0 like Td(True)
+    FT_COLUMN_STRING,  // Arrow style: num_rows + 1 offsets into UTF-8 data, escaped
+} ft_column_kind;
+
+typedef struct {
+    ft_column_kind kind;
+    const void* values;   // num_rows values, or the string data
+    size_t data_length;   // strings: size of the data
+    const void* offsets;  // strings: int32 or int64 offsets
+    int offset_size;      // 4 or 8
+} ft_column;
+
+typedef struct {
+    const ft_column* columns;
+    size_t num_columns;
+    size_t num_rows;
+    const char* const* headers;  // num_columns header texts, or NULL for no header row
+    const size_t* header_lengths;
+} ft_table;
+
+// Largest output of ft_write_table, or (size_t)-1 if the offsets of a string
+// column decrease or point past its data.
+size_t ft_table_max(const ft_table* table, int indent);
+size_t ft_write_table(char* out, const ft_table* table, int indent);
+
+// Visible text of markup, for search indexing: tags and comments removed,
+// script and style contents skipped, entities decoded and whitespace
+// collapsed to single spaces without leading or trailing ones. Tags other
+// than inline ones like <b> and <a> separate words. out needs room for
+// length bytes, the output is never longer.
+size_t ft_extract_text(char* out, const char* data, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // FASTTAG_CORE_H
@@ -2,6 +2,49 @@
 #include <Python.h>
 #include <string.h>
 
+#define FASTTAG_MODULE
+#include "capi.h"
+#include "core.h"
+
+#ifndef Py_TPFLAGS_IMMUTABLETYPE
+// Before Python 3.10 heap types' attributes can be set, nothing else changes
+#define Py_TPFLAGS_IMMUTABLETYPE 0
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FASTTAG_HAVE_SPILL 1
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__STDC_NO_ATOMICS__)
+#define FASTTAG_HAVE_SHM 1
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#endif
+
+// USDT probes for bpftrace/perf (provider "fasttag"), compiled in when sys/sdt.h
+// (systemtap-sdt-dev) is available unless FASTTAG_NO_PROBES is defined. A probe
+// site is a single nop until a tracer attaches to it.
+#if !defined(FASTTAG_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define FASTTAG_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef FASTTAG_HAVE_PROBES
+#define FASTTAG_PROBE(name, ...) STAP_PROBEV(fasttag, name, __VA_ARGS__)
+#else
+#define FASTTAG_PROBE(name, ...) do {} while (0)
+#endif
+
 // TODO: simpler memory management: malloc 32k buffer, realloc if needed
 // TODO: object
 // TODO: SVG namespace
@@ -11,31 +54,654 @@
 typedef struct {
     PyObject_HEAD
     Py_ssize_t size;
-    char data[];
+    char *data;         // points to storage, or to a file mapping once spilled
+    Py_ssize_t mapped;  // length of the file mapping, 0 if data lives in storage
+    int fd;             // file backing the mapping, -1 if data lives in storage
+    PyObject* owner;    // object owning the memory data points into, or NULL
+    Py_buffer* buffer;  // set when data is an adopted buffer, which lives in storage
+    PyObject* str;      // str() of data, cached on first conversion
+    // Room left around the used part of storage, for prepend_raw/append_raw:
+    // headroom bytes at the start, tailroom bytes after end (the offset past
+    // the terminating NUL).
+    Py_ssize_t headroom, tailroom, end;
+    char ascii;         // ASCII_UNKNOWN, or whether data is pure ASCII
+    char storage[];
 } HTMLObject;
 
-// Forward declaration of the type
-static PyTypeObject HTML_Type;
-#define HTMLObject_Check(op) PyObject_TypeCheck(op, &HTML_Type)
+// Renders that are only made of ASCII parts are marked ASCII_YES, so that
+// str() is a copy into a compact ASCII string; others are checked on first
+// conversion.
+#define ASCII_UNKNOWN 0
+#define ASCII_YES 1
+#define ASCII_NO 2
+
+// HTML is a heap type created per module (interpreter), and can't be
+// subclassed, so it's recognised by its deallocator.
+static void HTML_dealloc(HTMLObject* self);
+#define HTMLObject_Check(op) (Py_TYPE(op)->tp_dealloc == (destructor)HTML_dealloc)
+
+static void Arena_dealloc(PyObject* self);
+#define Arena_Check(op) (Py_TYPE(op)->tp_dealloc == Arena_dealloc)
+
+// The HTML tags that have a function, X(tag) for each
+#define FASTTAG_TAGS(X) \
+    X(a) \
+    X(abbr) \
+    X(address) \
+    X(area) \
+    X(article) \
+    X(aside) \
+    X(audio) \
+    X(b) \
+    X(base) \
+    X(bdi) \
+    X(bdo) \
+    X(blockquote) \
+    X(body) \
+    X(br) \
+    X(button) \
+    X(canvas) \
+    X(caption) \
+    X(cite) \
+    X(code) \
+    X(col) \
+    X(colgroup) \
+    X(data) \
+    X(datalist) \
+    X(dd) \
+    X(del) \
+    X(details) \
+    X(dfn) \
+    X(dialog) \
+    X(div) \
+    X(dl) \
+    X(dt) \
+    X(em) \
+    X(embed) \
+    X(fieldset) \
+    X(figcaption) \
+    X(figure) \
+    X(footer) \
+    X(form) \
+    X(h1) \
+    X(h2) \
+    X(h3) \
+    X(h4) \
+    X(h5) \
+    X(h6) \
+    X(head) \
+    X(header) \
+    X(hgroup) \
+    X(hr) \
+    X(html) \
+    X(i) \
+    X(iframe) \
+    X(img) \
+    X(input) \
+    X(ins) \
+    X(kbd) \
+    X(label) \
+    X(legend) \
+    X(li) \
+    X(link) \
+    X(main) \
+    X(map) \
+    X(mark) \
+    X(meta) \
+    X(meter) \
+    X(nav) \
+    X(noscript) \
+    X(object) \
+    X(ol) \
+    X(optgroup) \
+    X(option) \
+    X(output) \
+    X(p) \
+    X(param) \
+    X(picture) \
+    X(pre) \
+    X(progress) \
+    X(q) \
+    X(rp) \
+    X(rt) \
+    X(ruby) \
+    X(s) \
+    X(samp) \
+    X(script) \
+    X(section) \
+    X(select) \
+    X(small) \
+    X(source) \
+    X(span) \
+    X(strong) \
+    X(style) \
+    X(sub) \
+    X(summary) \
+    X(sup) \
+    X(table) \
+    X(tbody) \
+    X(td) \
+    X(template) \
+    X(textarea) \
+    X(tfoot) \
+    X(th) \
+    X(thead) \
+    X(time) \
+    X(title) \
+    X(tr) \
+    X(track) \
+    X(u) \
+    X(ul) \
+    X(var) \
+    X(video) \
+    X(wbr) \
+    X(acronym) \
+    X(applet) \
+    X(basefont) \
+    X(bgsound) \
+    X(big) \
+    X(blink) \
+    X(center) \
+    X(content) \
+    X(dir) \
+    X(element) \
+    X(font) \
+    X(frame) \
+    X(frameset) \
+    X(image) \
+    X(isindex) \
+    X(keygen) \
+    X(listing) \
+    X(marquee) \
+    X(menu) \
+    X(menuitem) \
+    X(multicol) \
+    X(nextid) \
+    X(nobr) \
+    X(noembed) \
+    X(noframes) \
+    X(plaintext) \
+    X(shadow) \
+    X(spacer) \
+    X(strike) \
+    X(tt) \
+    X(xmp)
+
+#define TAG_INDEX(tag) TAG_INDEX_##tag,
+enum { FASTTAG_TAGS(TAG_INDEX) NUM_TAGS };
+
+// Size hints for tags rendered through tag(), indexed by a hash of the tag name.
+// Colliding names just share an estimate.
+#define GENERIC_SIZE_HINTS 64
+
+typedef struct intern_entry intern_entry;
+
+// Which protocol instances of a type are rendered with, cached per type
+// and checked against its version tag, which changes whenever the type or
+// one of its bases is modified.
+#define PROTOCOL_NONE 0
+#define PROTOCOL_HTML 1  // __html__
+#define PROTOCOL_FT 2    // __ft__
+#define PROTOCOL_INSTANCE 3  // neither on the type, but instances may have them
+#define PROTOCOL_CACHE_SIZE 256
+
+typedef struct {
+    PyTypeObject* type;  // borrowed, only compared
+    unsigned int version_tag;
+    char protocol;
+} protocol_entry;
+
+// Per-module state, so that each (sub)interpreter has its own types and settings
+typedef struct {
+    PyTypeObject* HTML_Type;
+    PyTypeObject* HTMLChunk_Type;
+    PyTypeObject* Template_Type;
+    PyTypeObject* Builder_Type;
+    PyTypeObject* Arena_Type;
+#ifdef FASTTAG_HAVE_SHM
+    PyTypeObject* FragmentStore_Type;
+#endif
+    PyObject* current_arena;  // ContextVar of the innermost entered arena
+    char arena_entered;       // whether any arena was, so renders can skip the lookup
+    void* spare_block;        // a freed arena block, for the next arena
+    int indent;
+    int iterate_children;
+    Py_ssize_t spill_threshold;
+    PyObject* spill_dir;
+    // Running estimates of each tag's output size, see fasttag_tag_render
+    Py_ssize_t tag_size_hints[NUM_TAGS];
+    Py_ssize_t generic_size_hints[GENERIC_SIZE_HINTS];
+    intern_entry* intern_table;
+    Py_ssize_t intern_size;
+    protocol_entry protocol_cache[PROTOCOL_CACHE_SIZE];
+    PyObject* str_html;  // interned "__html__"
+    PyObject* str_ft;    // interned "__ft__"
+    fasttag_CAPI capi;   // exported as _C_API, see capi.h
+} fasttag_state;
+
+// State of the module that defined type, for methods of the module's types
+#define TYPE_STATE(type) ((fasttag_state*)PyType_GetModuleState(type))
+// State of the module that exported api
+#define CAPI_STATE(api) ((fasttag_state*)((char*)(api) - offsetof(fasttag_state, capi)))
 
 // Method declarations
 static PyObject* HTML_new(PyTypeObject* type, PyObject* args, PyObject* kwds);
 static int HTML_init(HTMLObject* self, PyObject* args, PyObject* kwds);
-static void HTML_dealloc(HTMLObject* self);
+
+// Largest data an HTML object can hold, so that its size fits in Py_ssize_t
+#define MAX_HTML_SIZE (PY_SSIZE_T_MAX - (Py_ssize_t)sizeof(HTMLObject) - 1)
+
+// Size arithmetic: saturates at PY_SSIZE_T_MAX instead of
+// wrapping around, so that an impossible size fails there with OverflowError.
+static inline Py_ssize_t size_add(Py_ssize_t a, Py_ssize_t b) {
+    return a > PY_SSIZE_T_MAX - b ? PY_SSIZE_T_MAX : a + b;
+}
+
+static inline Py_ssize_t size_mul(Py_ssize_t a, Py_ssize_t b) {
+    return b != 0 && a > PY_SSIZE_T_MAX / b ? PY_SSIZE_T_MAX : a * b;
+}
+
+// Capacity to grow to for new_size bytes: factor times, or just enough near the limit
+static Py_ssize_t grown_capacity(Py_ssize_t new_size, Py_ssize_t factor) {
+    return new_size <= MAX_HTML_SIZE / factor ? new_size * factor : MAX_HTML_SIZE;
+}
+
 
 static PyObject* HTML_alloc(PyTypeObject* type, Py_ssize_t nitems) {
     // Allocate memory for the object plus space for the string data
     HTMLObject* self;
+    if (nitems < 0 || nitems > MAX_HTML_SIZE) {
+        return NULL;
+    }
     self = (HTMLObject*)PyObject_Malloc(_PyObject_SIZE(type) + nitems * sizeof(char));
     if (self != NULL) {
         memset(self, 0, _PyObject_SIZE(type));
         PyObject_INIT(self, type);
+        self->data = self->storage;
+        self->fd = -1;
+    }
+    return (PyObject*)self;
+}
+
+// Reallocates an object whose data lives in storage, keeping data pointing at
+// it, after the object's headroom and with its tailroom after nitems.
+static HTMLObject* HTML_realloc(HTMLObject* obj, Py_ssize_t nitems) {
+    if (nitems < 0 || nitems > MAX_HTML_SIZE - obj->headroom - obj->tailroom) {
+        return NULL;
+    }
+    obj = (HTMLObject*)PyObject_Realloc(obj, sizeof(HTMLObject) + obj->headroom + nitems + obj->tailroom);
+    if (obj != NULL) {
+        obj->data = obj->storage + obj->headroom;
+    }
+    return obj;
+}
+
+// Renders whose buffer grows past the module's spill_threshold bytes move to
+// an mmap'd temporary file in spill_dir instead of being reallocated on the
+// heap. A threshold of 0 disables spilling.
+#ifdef FASTTAG_HAVE_SPILL
+// spill_dir is bytes, NULL for $TMPDIR or /tmp
+static int spill_open(PyObject* spill_dir) {
+    const char* dir = spill_dir ? PyBytes_AS_STRING(spill_dir) : getenv("TMPDIR");
+    if (dir == NULL || dir[0] == '\0') {
+        dir = "/tmp";
+    }
+    PyObject* path = PyBytes_FromFormat("%s/fasttag-XXXXXX", dir);
+    if (!path) {
+        return -1;
+    }
+    int fd = mkstemp(PyBytes_AS_STRING(path));
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, PyBytes_AS_STRING(path));
+    } else {
+        // The file only lives as long as the mapping
+        unlink(PyBytes_AS_STRING(path));
+    }
+    Py_DECREF(path);
+    return fd;
+}
+
+// Moves the first used bytes of obj into a new file mapping of capacity bytes.
+static HTMLObject* HTML_spill(HTMLObject* obj, PyObject* spill_dir, Py_ssize_t used, Py_ssize_t capacity) {
+    int fd = spill_open(spill_dir);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (ftruncate(fd, capacity) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        close(fd);
+        return NULL;
+    }
+    char* map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        close(fd);
+        return NULL;
+    }
+    memcpy(map, obj->data, used);
+    // Spilled renders don't keep room around their data
+    obj->headroom = obj->tailroom = 0;
+    HTMLObject* shrunk = HTML_realloc(obj, 0);
+    if (shrunk != NULL) {
+        obj = shrunk;
+    }
+    obj->data = map;
+    obj->mapped = capacity;
+    obj->fd = fd;
+    return obj;
+}
+
+// Resizes the file mapping of a spilled object, returns -1 with an exception set on failure.
+static int HTML_remap(HTMLObject* obj, Py_ssize_t capacity) {
+    if (ftruncate(obj->fd, capacity) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+#ifdef __linux__
+    char* map = mremap(obj->data, obj->mapped, capacity, MREMAP_MAYMOVE);
+#else
+    munmap(obj->data, obj->mapped);
+    char* map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, obj->fd, 0);
+    if (map == MAP_FAILED) {
+        // The old mapping is gone, leave nothing for dealloc to unmap
+        PyErr_SetFromErrno(PyExc_OSError);
+        close(obj->fd);
+        obj->fd = -1;
+        obj->mapped = 0;
+        obj->data = obj->storage;
+        return -1;
+    }
+#endif
+    if (map == MAP_FAILED) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    obj->data = map;
+    obj->mapped = capacity;
+    return 0;
+}
+#endif
+
+// Inside `with fasttag.arena():` renders put their data in blocks that are
+// bump-allocated and freed together when the scope exits, instead of going
+// through the allocator for every element: most elements are copied into
+// their parent and dropped right away. Objects still alive at exit have their
+// data copied out into bytes of their own.
+//
+// The arena is kept in a context variable, so other threads and tasks don't
+// see it, and is only used by the thread that entered it.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN(n) (((n) + 7) & ~(Py_ssize_t)7)
+
+typedef struct arena_block {
+    struct arena_block* next;
+    Py_ssize_t capacity, used;
+    char data[];
+} arena_block;
+
+typedef struct {
+    PyObject_HEAD
+    arena_block* blocks;  // the one being filled first
+    HTMLObject** views;   // objects with data in the blocks, NULL when gone
+    Py_ssize_t num_views, views_capacity;
+    PyObject* token;      // resets the context variable on exit
+    unsigned long thread;
+    char active;
+} ArenaObject;
+
+// What an arena-backed object keeps in its storage
+typedef struct {
+    Py_ssize_t slot;      // index in views
+    Py_ssize_t capacity;  // bytes reserved at data
+} arena_view;
+
+#define ARENA_VIEW(obj) ((arena_view*)(obj)->storage)
+
+static char* arena_alloc(ArenaObject* arena, Py_ssize_t size) {
+    size = ARENA_ALIGN(size);
+    arena_block* block = arena->blocks;
+    if (!block || block->capacity - block->used < size) {
+        fasttag_state* st = TYPE_STATE(Py_TYPE(arena));
+        if (st->spare_block && size <= ARENA_BLOCK_SIZE) {
+            block = st->spare_block;
+            st->spare_block = NULL;
+        } else {
+            Py_ssize_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+            block = PyMem_Malloc(sizeof(arena_block) + capacity);
+            if (!block) {
+                return NULL;
+            }
+            block->capacity = capacity;
+        }
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    char* data = block->data + block->used;
+    block->used += size;
+    return data;
+}
+
+// Whether data..data+capacity is the last allocation of the current block
+static int arena_at_top(ArenaObject* arena, char* data, Py_ssize_t capacity) {
+    arena_block* block = arena->blocks;
+    return block && data + ARENA_ALIGN(capacity) == block->data + block->used;
+}
+
+// Keeps one block for the next arena, so that short scopes don't allocate
+static void arena_free_blocks(ArenaObject* arena) {
+    fasttag_state* st = TYPE_STATE(Py_TYPE(arena));
+    while (arena->blocks) {
+        arena_block* next = arena->blocks->next;
+        if (!st->spare_block && arena->blocks->capacity == ARENA_BLOCK_SIZE) {
+            st->spare_block = arena->blocks;
+        } else {
+            PyMem_Free(arena->blocks);
+        }
+        arena->blocks = next;
+    }
+}
+
+// The arena renders of this thread and context go to, or NULL
+static ArenaObject* arena_current(fasttag_state* st) {
+    if (!st->arena_entered) {
+        return NULL;
+    }
+    PyObject* value;
+    if (PyContextVar_Get(st->current_arena, NULL, &value) < 0) {
+        PyErr_Clear();
+        return NULL;
+    }
+    if (!value) {
+        return NULL;
+    }
+    ArenaObject* arena = (ArenaObject*)value;
+    Py_DECREF(value);  // the context keeps it alive
+    return arena->active && arena->thread == PyThread_get_thread_ident() ? arena : NULL;
+}
+
+// Bytes reserved before and after a framed render, see fasttag_framed
+typedef struct {
+    Py_ssize_t headroom, tailroom;
+} render_room;
+
+// Object for a render of up to nitems bytes, with its data in the current
+// arena if there is one, otherwise with room (headroom and tailroom bytes)
+// around it for framed renders.
+static HTMLObject* render_alloc(fasttag_state* st, Py_ssize_t nitems, const render_room* room) {
+    ArenaObject* arena = arena_current(st);
+    if (!arena) {
+        Py_ssize_t extra = room ? room->headroom + room->tailroom : 0;
+        HTMLObject* obj = (HTMLObject*)HTML_alloc(st->HTML_Type, nitems > MAX_HTML_SIZE - extra ? -1 : nitems + extra);
+        if (obj && room) {
+            obj->headroom = room->headroom;
+            obj->tailroom = room->tailroom;
+            obj->data = obj->storage + obj->headroom;
+        }
+        return obj;
+    }
+    if (arena->num_views == arena->views_capacity) {
+        Py_ssize_t capacity = arena->views_capacity ? arena->views_capacity * 2 : 256;
+        HTMLObject** views = PyMem_Realloc(arena->views, capacity * sizeof(HTMLObject*));
+        if (!views) {
+            return NULL;
+        }
+        arena->views = views;
+        arena->views_capacity = capacity;
+    }
+    char* data = arena_alloc(arena, nitems);
+    HTMLObject* obj = data ? (HTMLObject*)HTML_alloc(st->HTML_Type, sizeof(arena_view)) : NULL;
+    if (!obj) {
+        return NULL;
+    }
+    obj->data = data;
+    Py_INCREF(arena);
+    obj->owner = (PyObject*)arena;
+    ARENA_VIEW(obj)->slot = arena->num_views;
+    ARENA_VIEW(obj)->capacity = nitems;
+    arena->views[arena->num_views++] = obj;
+    return obj;
+}
+
+// Grows the arena-backed data of obj to capacity bytes: in place when it's
+// the last allocation and fits, otherwise by moving it.
+static int arena_grow(HTMLObject* obj, Py_ssize_t capacity) {
+    ArenaObject* arena = (ArenaObject*)obj->owner;
+    arena_view* view = ARENA_VIEW(obj);
+    arena_block* block = arena->blocks;
+    if (arena_at_top(arena, obj->data, view->capacity) &&
+        ARENA_ALIGN(capacity) - ARENA_ALIGN(view->capacity) <= block->capacity - block->used) {
+        block->used += ARENA_ALIGN(capacity) - ARENA_ALIGN(view->capacity);
+    } else {
+        char* data = arena_alloc(arena, capacity);
+        if (!data) {
+            return -1;
+        }
+        memcpy(data, obj->data, view->capacity);
+        obj->data = data;
+    }
+    view->capacity = capacity;
+    return 0;
+}
+
+// Gives back the unused end of obj's data when it's the last allocation.
+static void arena_shrink(HTMLObject* obj, Py_ssize_t capacity) {
+    ArenaObject* arena = (ArenaObject*)obj->owner;
+    arena_view* view = ARENA_VIEW(obj);
+    if (capacity < view->capacity && arena_at_top(arena, obj->data, view->capacity)) {
+        arena->blocks->used -= ARENA_ALIGN(view->capacity) - ARENA_ALIGN(capacity);
+        view->capacity = capacity;
+    }
+}
+
+// Takes obj out of its arena before its data moves elsewhere, giving the
+// space back if it's the last allocation; the data stays readable until the
+// arena allocates again. Returns the reference to the arena obj held.
+static ArenaObject* arena_release(HTMLObject* obj) {
+    ArenaObject* arena = (ArenaObject*)obj->owner;
+    arena_shrink(obj, 0);
+    arena->views[ARENA_VIEW(obj)->slot] = NULL;
+    obj->owner = NULL;
+    return arena;
+}
+
+// Moves the data of an arena-backed object into bytes of its own, for objects
+// that outlive the arena or whose data is read without holding the GIL.
+static int HTML_detach(HTMLObject* obj) {
+    if (!obj->owner || !Arena_Check(obj->owner)) {
+        return 0;
+    }
+    PyObject* copy = PyBytes_FromStringAndSize(obj->data, obj->size);
+    if (!copy) {
+        return -1;
+    }
+    ((ArenaObject*)obj->owner)->views[ARENA_VIEW(obj)->slot] = NULL;
+    obj->data = PyBytes_AS_STRING(copy);
+    Py_SETREF(obj->owner, copy);
+    return 0;
+}
+
+static PyObject* Arena_enter(ArenaObject* self, PyObject* Py_UNUSED(ignored)) {
+    if (self->active) {
+        PyErr_SetString(PyExc_RuntimeError, "Arena already entered");
+        return NULL;
+    }
+    fasttag_state* st = TYPE_STATE(Py_TYPE(self));
+    PyObject* token = PyContextVar_Set(st->current_arena, (PyObject*)self);
+    if (!token) {
+        return NULL;
     }
+    Py_XSETREF(self->token, token);
+    self->thread = PyThread_get_thread_ident();
+    self->active = 1;
+    st->arena_entered = 1;
+    Py_INCREF(self);
     return (PyObject*)self;
 }
 
-PyObject* HTMLObjectFromStringAndSize(const char* data, Py_ssize_t size) {
-    HTMLObject* obj = (HTMLObject*)HTML_alloc(&HTML_Type, size + 1);
+static PyObject* Arena_exit(ArenaObject* self, PyObject* args) {
+    if (!self->active) {
+        PyErr_SetString(PyExc_RuntimeError, "Arena not entered");
+        return NULL;
+    }
+    self->active = 0;
+    fasttag_state* st = TYPE_STATE(Py_TYPE(self));
+    if (PyContextVar_Reset(st->current_arena, self->token) < 0) {
+        // Exited in another context than it was entered in; leave that alone
+        PyErr_Clear();
+    }
+    Py_CLEAR(self->token);
+    // Detaching can drop the last reference to the arena
+    Py_INCREF(self);
+    for (Py_ssize_t i = 0; i < self->num_views; i++) {
+        if (self->views[i] && HTML_detach(self->views[i]) < 0) {
+            // The blocks stay until the remaining objects are gone
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+    self->num_views = 0;
+    arena_free_blocks(self);
+    Py_DECREF(self);
+    Py_RETURN_FALSE;
+}
+
+static void Arena_dealloc(PyObject* self) {
+    ArenaObject* arena = (ArenaObject*)self;
+    arena_free_blocks(arena);
+    PyMem_Free(arena->views);
+    Py_XDECREF(arena->token);
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyMethodDef Arena_methods[] = {
+    {"__enter__", (PyCFunction)Arena_enter, METH_NOARGS, "Render into this arena until exit"},
+    {"__exit__", (PyCFunction)Arena_exit, METH_VARARGS, "Copy out surviving objects and free the arena"},
+    {NULL},
+};
+
+static PyType_Slot Arena_slots[] = {
+    {Py_tp_dealloc, Arena_dealloc},
+    {Py_tp_methods, Arena_methods},
+    {0, NULL},
+};
+
+static PyType_Spec Arena_spec = {
+    .name = "fasttag.Arena",
+    .basicsize = sizeof(ArenaObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = Arena_slots,
+};
+
+static PyObject* fasttag_arena(PyObject* self, PyObject* Py_UNUSED(ignored)) {
+    fasttag_state* st = PyModule_GetState(self);
+    return PyType_GenericAlloc(st->Arena_Type, 0);
+}
+
+PyObject* HTMLObjectFromStringAndSize(PyTypeObject* type, const char* data, Py_ssize_t size) {
+    HTMLObject* obj = (HTMLObject*)HTML_alloc(type, size + 1);
     if (obj == NULL) {
         PyErr_SetString(PyExc_MemoryError, "Failed to allocate memory for data");
         return NULL;
@@ -51,11 +717,144 @@ HTMLObject* HTMLObjectShrink(HTMLObject* obj, Py_ssize_t new_size) {
     if (new_size < obj->size) {
         obj->size = new_size;
         obj->data[new_size] = '\0';  // Null-terminate the string
-        obj = (HTMLObject*)PyObject_Realloc(obj, _PyObject_SIZE(&HTML_Type) + (new_size + 1) * sizeof(char));
     }
+    if (obj->owner && Arena_Check(obj->owner)) {
+        arena_shrink(obj, new_size + 1);
+        return obj;
+    }
+#ifdef FASTTAG_HAVE_SPILL
+    if (obj->mapped) {
+        if (new_size + 1 < obj->mapped && HTML_remap(obj, new_size + 1) < 0) {
+            // Keeping the larger mapping is harmless
+            PyErr_Clear();
+        }
+        return obj;
+    }
+#endif
+    HTMLObject* shrunk = HTML_realloc(obj, new_size + 1);
+    obj = shrunk ? shrunk : obj;
+    obj->end = obj->headroom + obj->size + 1;
     return obj;
 }
 
+// HTML over the bytes of a buffer-protocol object, which it keeps a reference
+// to instead of copying. Writable buffers could change under the object and
+// its cached str, so they are copied, or rejected with BufferError if
+// no_copy is set.
+static PyObject* HTML_from_buffer(PyTypeObject* type, PyObject* arg, char no_copy) {
+    HTMLObject* self = (HTMLObject*)HTML_alloc(type, sizeof(Py_buffer));
+    if (!self) {
+        return PyErr_NoMemory();
+    }
+    Py_buffer* buffer = (Py_buffer*)self->storage;
+    if (PyObject_GetBuffer(arg, buffer, PyBUF_SIMPLE) < 0) {
+        Py_TYPE(self)->tp_free((PyObject*)self);
+        return NULL;
+    }
+    if (buffer->readonly) {
+        self->buffer = buffer;
+        self->data = buffer->buf;
+        self->size = buffer->len;
+        return (PyObject*)self;
+    }
+    HTMLObject* copy = no_copy ? NULL : (HTMLObject*)HTMLObjectFromStringAndSize(type, buffer->buf, buffer->len);
+    if (no_copy) {
+        PyErr_SetString(PyExc_BufferError, "HTML.view needs a read-only buffer");
+    }
+    PyBuffer_Release(buffer);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+    return (PyObject*)copy;
+}
+
+// HTML.view(buffer): never copies, for large static fragments loaded once
+// (bytes, or a read-only mmap of a file, which then can't be closed while in
+// use).
+static PyObject* HTML_view(PyTypeObject* type, PyObject* arg) {
+    return HTML_from_buffer(type, arg, 1);
+}
+
+// The object owning the storage that self's data is in: self, or the render
+// a prepend_raw/append_raw result was made from.
+static HTMLObject* HTML_base(HTMLObject* self) {
+    return self->owner && HTMLObject_Check(self->owner) ? (HTMLObject*)self->owner : self;
+}
+
+// HTML for length bytes at data, sharing base's storage
+static PyObject* HTML_room_view(HTMLObject* base, char* data, Py_ssize_t length) {
+    HTMLObject* view = (HTMLObject*)HTML_alloc(Py_TYPE(base), 0);
+    if (!view) {
+        return PyErr_NoMemory();
+    }
+    view->data = data;
+    view->size = length;
+    Py_INCREF(base);
+    view->owner = (PyObject*)base;
+    return (PyObject*)view;
+}
+
+// raw + self, written into the headroom when self starts right after it, so
+// that framing (an HTTP status line and headers, a chunk size) ends up in one
+// contiguous buffer with the body without copying it. Otherwise copies.
+static PyObject* HTML_prepend_raw(HTMLObject* self, PyObject* arg) {
+    Py_buffer raw;
+    if (PyObject_GetBuffer(arg, &raw, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    HTMLObject* base = HTML_base(self);
+    PyObject* result;
+    if (raw.len <= base->headroom && self->data == base->storage + base->headroom) {
+        base->headroom -= raw.len;
+        memcpy(self->data - raw.len, raw.buf, raw.len);
+        result = HTML_room_view(base, self->data - raw.len, raw.len + self->size);
+    } else if (raw.len > MAX_HTML_SIZE - 1 - self->size) {
+        PyErr_SetString(PyExc_OverflowError, "HTML too large");
+        result = NULL;
+    } else {
+        HTMLObject* copy = (HTMLObject*)HTML_alloc(Py_TYPE(self), raw.len + self->size + 1);
+        if (copy) {
+            memcpy(copy->data, raw.buf, raw.len);
+            memcpy(copy->data + raw.len, self->data, self->size);
+            copy->size = raw.len + self->size;
+            copy->data[copy->size] = '\0';
+        }
+        result = copy ? (PyObject*)copy : PyErr_NoMemory();
+    }
+    PyBuffer_Release(&raw);
+    return result;
+}
+
+// self + raw, in the tailroom when self ends at its used part, like prepend_raw.
+static PyObject* HTML_append_raw(HTMLObject* self, PyObject* arg) {
+    Py_buffer raw;
+    if (PyObject_GetBuffer(arg, &raw, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    HTMLObject* base = HTML_base(self);
+    PyObject* result;
+    if (raw.len <= base->tailroom && self->data + self->size + 1 == base->storage + base->end) {
+        // The NUL moves to after raw
+        base->tailroom -= raw.len;
+        base->end += raw.len;
+        memcpy(self->data + self->size, raw.buf, raw.len);
+        self->data[self->size + raw.len] = '\0';
+        result = HTML_room_view(base, self->data, self->size + raw.len);
+    } else if (raw.len > MAX_HTML_SIZE - 1 - self->size) {
+        PyErr_SetString(PyExc_OverflowError, "HTML too large");
+        result = NULL;
+    } else {
+        HTMLObject* copy = (HTMLObject*)HTML_alloc(Py_TYPE(self), self->size + raw.len + 1);
+        if (copy) {
+            memcpy(copy->data, self->data, self->size);
+            memcpy(copy->data + self->size, raw.buf, raw.len);
+            copy->size = self->size + raw.len;
+            copy->data[copy->size] = '\0';
+        }
+        result = copy ? (PyObject*)copy : PyErr_NoMemory();
+    }
+    PyBuffer_Release(&raw);
+    return result;
+}
+
 // Constructor for the custom type
 static PyObject* HTML_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
     HTMLObject* self;
@@ -69,14 +868,18 @@ static PyObject* HTML_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
     // bytes or string
     Py_ssize_t length;
     const char *data;
+    Py_ssize_t utf8_length;
     if (PyUnicode_Check(arg)) {
-        data = PyUnicode_AsUTF8(arg);
+        data = PyUnicode_AsUTF8AndSize(arg, &utf8_length);
+        if (!data) {
+            return NULL;
+        }
         length = strlen(data);
-    } else if (PyBytes_Check(arg)) {
-        length = PyBytes_Size(arg);
-        data = PyBytes_AsString(arg);
+    } else if (PyObject_CheckBuffer(arg)) {
+        // Immutable buffers (bytes, unpickled out-of-band buffers) are adopted without a copy
+        return HTML_from_buffer(type, arg, 0);
     } else {
-        PyErr_SetString(PyExc_TypeError, "Argument must be a string or bytes");
+        PyErr_SetString(PyExc_TypeError, "Argument must be a string or a bytes-like object");
         return NULL;
     }
     self = (HTMLObject*)HTML_alloc(type, length + 1);
@@ -84,6 +887,12 @@ static PyObject* HTML_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
         self->size = length;
         memcpy(self->data, data, length);
         self->data[length] = '\0';  // Null-terminate the string
+        self->ascii = PyUnicode_IS_ASCII(arg) ? ASCII_YES : ASCII_NO;
+        if (length == utf8_length && PyUnicode_CheckExact(arg)) {
+            // str(HTML(s)) is s
+            Py_INCREF(arg);
+            self->str = arg;
+        }
     }
     return (PyObject*)self;
 }
@@ -95,34 +904,156 @@ static int HTML_init(HTMLObject* self, PyObject* args, PyObject* kwds) {
 
 static void HTML_dealloc(HTMLObject* self) {
     self->size = 0;
-    Py_TYPE(self)->tp_free((PyObject*)self);
+#ifdef FASTTAG_HAVE_SPILL
+    if (self->mapped) {
+        munmap(self->data, self->mapped);
+        close(self->fd);
+    }
+#endif
+    if (self->buffer) {
+        PyBuffer_Release(self->buffer);
+    }
+    Py_XDECREF(self->str);
+    if (self->owner) {
+        if (Arena_Check(self->owner)) {
+            ((ArenaObject*)self->owner)->views[ARENA_VIEW(self)->slot] = NULL;
+        }
+        Py_DECREF(self->owner);
+    }
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
 }
 
 static PyObject* HTML_bytes(HTMLObject* self, PyObject* Py_UNUSED(ignored)) {
     return PyBytes_FromStringAndSize(self->data, self->size);
 }
 
+// HTML is immutable, so the first conversion is kept for later ones
+// (frameworks call __html__ and str() on the same object several times).
 static PyObject* HTML_str(PyObject* self) {
     HTMLObject* obj = (HTMLObject*)self;
-    return PyUnicode_FromStringAndSize(obj->data, obj->size);
+    if (!obj->str) {
+        if (obj->ascii == ASCII_UNKNOWN) {
+            obj->ascii = ft_is_ascii(obj->data, obj->size) ? ASCII_YES : ASCII_NO;
+        }
+        if (obj->ascii == ASCII_YES) {
+            obj->str = PyUnicode_New(obj->size, 127);
+            if (obj->str) {
+                memcpy(PyUnicode_1BYTE_DATA(obj->str), obj->data, obj->size);
+            }
+        } else {
+            obj->str = PyUnicode_DecodeUTF8(obj->data, obj->size, NULL);
+        }
+        if (!obj->str) {
+            return NULL;
+        }
+    }
+    Py_INCREF(obj->str);
+    return obj->str;
 }
 
 static PyObject* HTML_repr(PyObject* self) {
     HTMLObject* obj = (HTMLObject*)self;
-    return PyUnicode_FromFormat("<fasttag.HTML>%s</fasttag.HTML>", obj->data);
+    PyObject* str = PyUnicode_DecodeUTF8(obj->data, obj->size, "replace");
+    if (!str) {
+        return NULL;
+    }
+    PyObject* repr = PyUnicode_FromFormat("<fasttag.HTML>%U</fasttag.HTML>", str);
+    Py_DECREF(str);
+    return repr;
 }
 
-static PyObject* HTML_add(PyObject* left, PyObject* right) {
-    if (!PyObject_TypeCheck(left, &HTML_Type) || !PyObject_TypeCheck(right, &HTML_Type)) {
+// Growable block that repeated concatenation appends into, so that building a
+// page with += is linear. Results of += point into a chunk (as their owner).
+// The bytes after used aren't part of any HTML object yet, so an object ending
+// exactly at used can be extended in place while earlier objects still see
+// their own unchanged prefix. A full chunk is copied into one twice the size.
+typedef struct {
+    PyObject_VAR_HEAD  // ob_size is the capacity
+    Py_ssize_t used;
+    char data[];
+} HTMLChunkObject;
+
+static void HTMLChunk_dealloc(PyObject* self) {
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+#define HTMLChunk_Check(op) (Py_TYPE(op)->tp_dealloc == HTMLChunk_dealloc)
+
+static PyType_Slot HTMLChunk_slots[] = {
+    {Py_tp_dealloc, HTMLChunk_dealloc},
+    {0, NULL},
+};
+
+static PyType_Spec HTMLChunk_spec = {
+    .name = "fasttag.HTMLChunk",
+    .basicsize = sizeof(HTMLChunkObject),
+    .itemsize = 1,
+    .flags = Py_TPFLAGS_DEFAULT,
+    .slots = HTMLChunk_slots,
+};
+
+#define MIN_CHUNK_SIZE 256
+
+// Returns an HTML object of type for length bytes at data in chunk.
+static PyObject* HTMLChunk_view(PyTypeObject* type, HTMLChunkObject* chunk, char* data, Py_ssize_t length) {
+    HTMLObject* view = (HTMLObject*)HTML_alloc(type, 0);
+    if (!view) {
+        return PyErr_NoMemory();
+    }
+    view->data = data;
+    view->size = length;
+    Py_INCREF(chunk);
+    view->owner = (PyObject*)chunk;
+    return (PyObject*)view;
+}
+
+// left + right, appending into left's chunk when possible. grow starts a chunk
+// for the result when left isn't in one, which only += does: one-off
+// concatenations like DOCTYPE + page shouldn't reserve twice their size.
+static PyObject* HTML_concat(PyObject* left, PyObject* right, char grow) {
+    if (!HTMLObject_Check(left) || !HTMLObject_Check(right)) {
         PyErr_SetString(PyExc_TypeError, "Operands must be of type HTML");
         return NULL;
     }
+    PyTypeObject* type = Py_TYPE(left);
 
     HTMLObject* left_obj = (HTMLObject*)left;
     HTMLObject* right_obj = (HTMLObject*)right;
 
     Py_ssize_t new_length = left_obj->size + right_obj->size;
-    HTMLObject* result = (HTMLObject*)HTML_alloc(&HTML_Type, new_length + 1);
+    if (new_length > MAX_HTML_SIZE) {
+        PyErr_SetString(PyExc_OverflowError, "HTML too large");
+        return NULL;
+    }
+    if (left_obj->owner && HTMLChunk_Check(left_obj->owner)) {
+        HTMLChunkObject* chunk = (HTMLChunkObject*)left_obj->owner;
+        if (left_obj->data + left_obj->size == chunk->data + chunk->used &&
+            right_obj->size <= Py_SIZE(chunk) - chunk->used) {
+            memcpy(chunk->data + chunk->used, right_obj->data, right_obj->size);
+            chunk->used += right_obj->size;
+            return HTMLChunk_view(type, chunk, left_obj->data, new_length);
+        }
+        grow = 1;
+    }
+    if (grow) {
+        Py_ssize_t capacity = new_length < MIN_CHUNK_SIZE / 2 ? MIN_CHUNK_SIZE : grown_capacity(new_length, 2);
+        HTMLChunkObject* chunk = PyObject_NewVar(HTMLChunkObject, TYPE_STATE(type)->HTMLChunk_Type, capacity);
+        if (!chunk) {
+            return NULL;
+        }
+        memcpy(chunk->data, left_obj->data, left_obj->size);
+        memcpy(chunk->data + left_obj->size, right_obj->data, right_obj->size);
+        chunk->used = new_length;
+        PyObject* result = HTMLChunk_view(type, chunk, chunk->data, new_length);
+        Py_DECREF(chunk);
+        return result;
+    }
+
+    HTMLObject* result = (HTMLObject*)HTML_alloc(type, new_length + 1);
     if (result == NULL) {
         PyErr_SetString(PyExc_MemoryError, "Failed to allocate memory for data");
         return NULL;
@@ -135,8 +1066,27 @@ static PyObject* HTML_add(PyObject* left, PyObject* right) {
     return (PyObject*)result;
 }
 
+// Concatenations of ASCII are ASCII
+static PyObject* concat_ascii(PyObject* result, PyObject* left, PyObject* right) {
+    if (result && ((HTMLObject*)left)->ascii == ASCII_YES && ((HTMLObject*)right)->ascii == ASCII_YES) {
+        ((HTMLObject*)result)->ascii = ASCII_YES;
+    }
+    return result;
+}
+
+static PyObject* HTML_add(PyObject* left, PyObject* right) {
+    return concat_ascii(HTML_concat(left, right, 0), left, right);
+}
+
+// HTML is immutable, so += returns a new object too, but one sharing a chunk
+// with left. Growing left itself when nothing else refers to it doesn't work:
+// the variable being assigned to still holds a reference during the call.
+static PyObject* HTML_inplace_add(PyObject* left, PyObject* right) {
+    return concat_ascii(HTML_concat(left, right, 1), left, right);
+}
+
 static PyObject* HTML_richcompare(PyObject* a, PyObject* b, int op) {
-    if (!PyObject_TypeCheck(a, &HTML_Type) || !PyObject_TypeCheck(b, &HTML_Type)) {
+    if (!HTMLObject_Check(a) || !HTMLObject_Check(b)) {
         Py_RETURN_NOTIMPLEMENTED;
     }
 
@@ -144,13 +1094,13 @@ static PyObject* HTML_richcompare(PyObject* a, PyObject* b, int op) {
     HTMLObject* b_obj = (HTMLObject*)b;
 
     if (op == Py_EQ) {
-        if (a_obj->size == b_obj->size && strcmp(a_obj->data, b_obj->data) == 0) {
+        if (a_obj->size == b_obj->size && memcmp(a_obj->data, b_obj->data, a_obj->size) == 0) {
             Py_RETURN_TRUE;
         } else {
             Py_RETURN_FALSE;
         }
     } else if (op == Py_NE) {
-        if (a_obj->size == b_obj->size && strcmp(a_obj->data, b_obj->data) == 0) {
+        if (a_obj->size == b_obj->size && memcmp(a_obj->data, b_obj->data, a_obj->size) == 0) {
             Py_RETURN_FALSE;
         } else {
             Py_RETURN_TRUE;
@@ -161,11 +1111,14 @@ static PyObject* HTML_richcompare(PyObject* a, PyObject* b, int op) {
 }
 
 
-// Define the number methods
-static PyNumberMethods HTML_as_number = {
-    .nb_add = HTML_add,  // Addition
-    // Other number methods can be added here
-};
+// Exposes data read-only, so memoryview(html) and socket writes don't copy it
+static int HTML_getbuffer(HTMLObject* self, Py_buffer* view, int flags) {
+    // The view can outlive an arena
+    if (HTML_detach(self) < 0) {
+        return -1;
+    }
+    return PyBuffer_FillInfo(view, (PyObject*)self, self->data, self->size, 1, flags);
+}
 
 
 static PyObject* HTML_self(PyObject* self) {
@@ -173,14 +1126,19 @@ static PyObject* HTML_self(PyObject* self) {
     return self;
 }
 
+// Data isn't always null-terminated (adopted buffers), so parsing reads
+// through AT, which yields '\0' past the end
+#define AT(p) ((p) < end ? *(p) : '\0')
+
 static PyObject * HTML_get_tag(HTMLObject *self) {
     char *tag = self->data;
-    if (tag[0] != '<') {
+    char *end = self->data + self->size;
+    if (AT(tag) != '<') {
         return PyUnicode_FromStringAndSize("", 0);
     }
     tag++;
     char *tag_end = tag;
-    while (*tag_end != ' ' && *tag_end != '>' && *tag_end != '\0') {
+    while (AT(tag_end) != ' ' && AT(tag_end) != '>' && AT(tag_end) != '\0') {
         tag_end++;
     }
     return PyUnicode_FromStringAndSize(tag, tag_end - tag);
@@ -188,85 +1146,113 @@ static PyObject * HTML_get_tag(HTMLObject *self) {
 
 static PyObject * HTML_get_attrs(HTMLObject *self) {
     char *tag = self->data;
-    if (tag[0] != '<') {
+    char *end = self->data + self->size;
+    if (AT(tag) != '<') {
         return PyUnicode_FromStringAndSize("", 0);
     }
     // allocate temporary space for unescaped string
     char *unescaped = (char*)malloc(self->size + 1);
+    if (!unescaped) {
+        return PyErr_NoMemory();
+    }
     tag++;
     // skip tag
-    while (*tag != ' ' && *tag != '>' && *tag != '\0') {
+    while (AT(tag) != ' ' && AT(tag) != '>' && AT(tag) != '\0') {
         tag++;
     }
     // Create a dict
     PyObject *dict = PyDict_New();
-    while (*tag != '>' && *tag != '\0') {
+    if (!dict) {
+        free(unescaped);
+        return NULL;
+    }
+    while (AT(tag) != '>' && AT(tag) != '\0') {
         // Skip whitespace
-        while (*tag == ' ') {
+        while (AT(tag) == ' ') {
             tag++;
         }
         // Find the key
         char *key = tag;
-        while (*tag != '=' && *tag != ' ' && *tag != '>' && *tag != '\0') {
+        while (AT(tag) != '=' && AT(tag) != ' ' && AT(tag) != '>' && AT(tag) != '\0') {
             tag++;
         }
         PyObject *key_str = PyUnicode_FromStringAndSize(key, tag - key);
-        if (*tag == '>' || *tag == '\0') {
-            PyDict_SetItem(dict, key_str, Py_True);
+        if (!key_str) {
+            goto error;
+        }
+        if (AT(tag) == '>' || AT(tag) == '\0') {
+            int failed = PyDict_SetItem(dict, key_str, Py_True);
             Py_DECREF(key_str);
+            if (failed) {
+                goto error;
+            }
             break;
         }
         // Skip whitespace
-        while (*tag == ' ') {
+        while (AT(tag) == ' ') {
             tag++;
         }
         // Skip =
         tag++;
         // Skip whitespace
-        while (*tag == ' ') {
+        while (AT(tag) == ' ') {
             tag++;
         }
         // Find the value
-        char *end = unescaped;
-        if (*tag == '"') {
+        char *out = unescaped;
+        if (AT(tag) == '"') {
             tag++;
             // unescape value
-            while (*tag != '"' && *tag != '\0') {
-                if (*tag == '&') {
-                    if (tag[1] == 'l' && tag[2] == 't' && tag[3] == ';') {
-                        *end++ = '<';
+            while (AT(tag) != '"' && AT(tag) != '\0') {
+                if (AT(tag) == '&') {
+                    if (AT(tag + 1) == 'l' && AT(tag + 2) == 't' && AT(tag + 3) == ';') {
+                        *out++ = '<';
                         tag += 4;
-                    } else if (tag[1] == 'a' && tag[2] == 'm' && tag[3] == 'p' && tag[4] == ';') {
-                        *end++ = '&';
+                    } else if (AT(tag + 1) == 'a' && AT(tag + 2) == 'm' && AT(tag + 3) == 'p' && AT(tag + 4) == ';') {
+                        *out++ = '&';
                         tag += 5;
                     } else {
-                        *end++ = *tag++;
+                        *out++ = *tag++;
                     }
                 } else {
-                    *end++ = *tag++;
+                    *out++ = *tag++;
                 }
             }
-            *end = '\0';
-            PyObject *value_str = PyUnicode_FromStringAndSize(unescaped, end - unescaped);
-            PyDict_SetItem(dict, key_str, value_str);
+            *out = '\0';
+            PyObject *value_str = PyUnicode_FromStringAndSize(unescaped, out - unescaped);
+            if (!value_str || PyDict_SetItem(dict, key_str, value_str) < 0) {
+                Py_XDECREF(value_str);
+                Py_DECREF(key_str);
+                goto error;
+            }
             Py_DECREF(value_str);
-            if (*tag == '\0') {
+            if (AT(tag) == '\0') {
+                Py_DECREF(key_str);
                 break;
             }
             tag++;
         } else {
             char *value = tag;
-            while (*tag != ' ' && *tag != '>' && *tag != '\0') {
+            while (AT(tag) != ' ' && AT(tag) != '>' && AT(tag) != '\0') {
                 tag++;
             }
             PyObject *value_str = PyUnicode_FromStringAndSize(value, tag - value);
-            PyDict_SetItem(dict, key_str, value_str);
+            if (!value_str || PyDict_SetItem(dict, key_str, value_str) < 0) {
+                Py_XDECREF(value_str);
+                Py_DECREF(key_str);
+                goto error;
+            }
             Py_DECREF(value_str);
         }
         Py_DECREF(key_str);
     }
     free(unescaped);
     return dict;
+
+error:
+    free(unescaped);
+    Py_DECREF(dict);
+    return NULL;
 }
 
 // TODO: finish implementation
@@ -339,202 +1325,557 @@ static PyObject* HTML_reduce(HTMLObject* self) {
     return (PyObject*)result;
 }
 
+// Protocol 5 pickles data as a PickleBuffer: out-of-band when the pickler has a
+// buffer_callback, and unpickling adopts the buffer instead of copying it
+static PyObject* HTML_reduce_ex(HTMLObject* self, PyObject* arg) {
+    int protocol = PyLong_AsLong(arg);
+    if (protocol == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (protocol < 5) {
+        return HTML_reduce(self);
+    }
+    PyObject* buffer = PyPickleBuffer_FromObject((PyObject*)self);
+    if (!buffer) {
+        return NULL;
+    }
+    return Py_BuildValue("O(N)", Py_TYPE(self), buffer);
+}
+
+// Text for search indexing, see ft_extract_text
+static PyObject* HTML_text(HTMLObject* self, PyObject* Py_UNUSED(ignored)) {
+    // Read without the GIL
+    if (HTML_detach(self) < 0) {
+        return NULL;
+    }
+    char* out = PyMem_Malloc(self->size + 1);
+    if (!out) {
+        return PyErr_NoMemory();
+    }
+    size_t length;
+    Py_BEGIN_ALLOW_THREADS
+    length = ft_extract_text(out, self->data, self->size);
+    Py_END_ALLOW_THREADS
+    // bytes children may have left invalid UTF-8
+    PyObject* result = PyUnicode_DecodeUTF8(out, length, "replace");
+    PyMem_Free(out);
+    return result;
+}
+
 // Method table for the custom type
 static PyMethodDef HTML_methods[] = {
     {"bytes", (PyCFunction)HTML_bytes, METH_NOARGS, "Return the data attribute"},
+    {"prepend_raw", (PyCFunction)HTML_prepend_raw, METH_O, "Return bytes + self, written in front of the data without copying it when the render has headroom left"},
+    {"append_raw", (PyCFunction)HTML_append_raw, METH_O, "Return self + bytes, written after the data without copying it when the render has tailroom left"},
+    {"view", (PyCFunction)HTML_view, METH_O | METH_CLASS, "HTML over the bytes of a read-only buffer (bytes, read-only mmap) without copying them; writable buffers raise BufferError"},
     {"__reduce__", (PyCFunction)HTML_reduce, METH_NOARGS, "Return a tuple for pickling"},
+    {"__reduce_ex__", (PyCFunction)HTML_reduce_ex, METH_O, "Return a tuple for pickling, with a PickleBuffer for protocol 5"},
     {"__html__", (PyCFunction)HTML_str, METH_NOARGS, "Return the data attribute as string"},
+    {"text", (PyCFunction)HTML_text, METH_NOARGS, "Return the visible text, without tags, script and style, with entities decoded and whitespace collapsed"},
     {"__ft__", (PyCFunction)HTML_self, METH_NOARGS, "Return self"},
     {NULL} // Sentinel
 };
 
-// Define the type object
-static PyTypeObject HTML_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "fasttag.HTML",
-    .tp_doc = "HTML string",
-    .tp_basicsize = sizeof(HTMLObject),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_new = HTML_new,
-    .tp_init = (initproc)HTML_init,
-    .tp_dealloc = (destructor)HTML_dealloc,
-    .tp_methods = HTML_methods,
-    .tp_str = HTML_str,
-    .tp_repr = HTML_repr,
-    .tp_as_number = &HTML_as_number,
-    .tp_richcompare = HTML_richcompare,
-    .tp_getset = HTML_getsetters,
+// Define the type, created for each module by fasttag_exec
+static PyType_Slot HTML_slots[] = {
+    {Py_tp_doc, "HTML string"},
+    {Py_tp_new, HTML_new},
+    {Py_tp_init, HTML_init},
+    {Py_tp_dealloc, HTML_dealloc},
+    {Py_tp_methods, HTML_methods},
+    {Py_tp_str, HTML_str},
+    {Py_tp_repr, HTML_repr},
+    {Py_nb_add, HTML_add},
+    {Py_nb_inplace_add, HTML_inplace_add},
+    {Py_bf_getbuffer, HTML_getbuffer},
+    {Py_tp_richcompare, HTML_richcompare},
+    {Py_tp_getset, HTML_getsetters},
+    {0, NULL},
 };
 
-int indent = 2;
+static PyType_Spec HTML_spec = {
+    .name = "fasttag.HTML",
+    .basicsize = sizeof(HTMLObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = HTML_slots,
+};
 
-// Function to check if a tag is self-closing
-int is_self_closing_tag(const char *tag) {
-    if (tag == NULL || tag[0] == '\0') return 0;
+#ifdef FASTTAG_HAVE_SHM
+// Fragment store: rendered fragments shared between processes through a
+// POSIX shared memory segment. The segment is a header, a table of slots
+// and one fixed-size block of data per slot. Slots are found by open
+// addressing from the key's hash.
+//
+// Each slot's state word holds its state in the low 2 bits, and above them
+// a version for READY slots, or the pid of the writer for WRITING ones.
+// Writers claim a slot by CAS-ing it to WRITING and publish it as READY with
+// a new version. Readers hold nothing: get copies the block and checks that
+// the state word didn't change meanwhile, like a seqlock, so a process dying
+// at any point can't keep an entry from being replaced. A slot left WRITING
+// by a writer that died is reclaimed once its pid is gone.
+
+#define STORE_MAGIC 0x6674737432ULL  // "ftst2"
+#define STORE_PROBES 8
+#define STORE_READ_RETRIES 4
+#define SLOT_EMPTY 0
+#define SLOT_WRITING 1
+#define SLOT_READY 2
+#define SLOT_STATE(word) ((word) & 3)
+#define SLOT_WORD(value, state) (((uint64_t)(value) << 2) | (state))
 
-    switch (tag[0]) {
-        case 'a':
-            if (strcmp(tag, "area") == 0) return 1;
-            break;
-        case 'b':
-            if (strcmp(tag, "base") == 0 || strcmp(tag, "br") == 0) return 1;
-            break;
-        case 'c':
-            if (strcmp(tag, "col") == 0) return 1;
-            break;
-        case 'e':
-            if (strcmp(tag, "embed") == 0) return 1;
-            break;
-        case 'h':
-            if (strcmp(tag, "hr") == 0) return 1;
-            break;
-        case 'i':
-            if (strcmp(tag, "img") == 0 || strcmp(tag, "input") == 0) return 1;
-            break;
-        case 'l':
-            if (strcmp(tag, "link") == 0) return 1;
-            break;
-        case 'm':
-            if (strcmp(tag, "meta") == 0) return 1;
-            break;
-        case 's':
-            if (strcmp(tag, "source") == 0) return 1;
-            break;
-        case 't':
-            if (strcmp(tag, "track") == 0) return 1;
-            break;
-        case 'w':
-            if (strcmp(tag, "wbr") == 0) return 1;
-            break;
+typedef struct {
+    _Atomic uint64_t magic;
+    uint64_t nslots;
+    uint64_t block_size;
+    _Atomic uint64_t clock;  // source of slot stamps, for evicting the oldest entry
+} store_header;
+
+typedef struct {
+    _Atomic uint64_t state;
+    _Atomic uint64_t stamp;
+    uint64_t key;
+    uint64_t length;
+} store_slot;
+
+typedef struct {
+    PyObject_HEAD
+    char* map;
+    Py_ssize_t map_size;
+    store_header* header;
+    store_slot* slots;
+    char* blocks;
+    PyObject* name;  // bytes
+} FragmentStoreObject;
+
+// FNV-1a, stable across processes unlike Python's hash()
+static uint64_t store_hash(const char* data, Py_ssize_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (Py_ssize_t i = 0; i < size; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
     }
-    return 0;
+    return hash;
 }
 
-int estimate_object_length(PyObject* obj) {
-    if (PyUnicode_Check(obj)) {
-        return PyUnicode_GetLength(obj);
-    } else if (PyBytes_Check(obj)) {
-        return PyBytes_Size(obj);
-    } else if (HTMLObject_Check(obj)) {
-        HTMLObject* html_obj = (HTMLObject*)obj;
-        return html_obj->size;
-    } else if (PyLong_Check(obj)) {
-        return 20;
-    } else if (PyFloat_Check(obj)) {
-        return 20;
-    } else if (PyTuple_Check(obj)) {
-        Py_ssize_t num_args = PyTuple_Size(obj);
-        int total_length = 0;
-        for (Py_ssize_t i = 0; i < num_args; i++) {
-            PyObject* item = PyTuple_GetItem(obj, i);
-            int object_length = estimate_object_length(item);
-            if (object_length < 0) {
-                return -1;
-            }
-            total_length += object_length;
+static int store_key(PyObject* key, uint64_t* hash) {
+    const char* data;
+    Py_ssize_t size;
+    if (PyUnicode_Check(key)) {
+        data = PyUnicode_AsUTF8AndSize(key, &size);
+        if (!data) {
+            return -1;
         }
-        total_length += num_args;
-        return total_length;
+    } else if (PyBytes_Check(key)) {
+        data = PyBytes_AS_STRING(key);
+        size = PyBytes_GET_SIZE(key);
     } else {
-        PyErr_SetString(PyExc_TypeError, "All arguments must be strings or bytes or number");
+        PyErr_SetString(PyExc_TypeError, "Key must be a string or bytes");
         return -1;
     }
+    *hash = store_hash(data, size);
+    return 0;
+}
+
+static PyObject* FragmentStore_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {"name", "size", "block_size", NULL};
+    PyObject* name;
+    Py_ssize_t size = 64 * 1024 * 1024;
+    Py_ssize_t block_size = 16 * 1024;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|nn", kwlist, PyUnicode_FSConverter, &name,
+                                     &size, &block_size)) {
+        return NULL;
+    }
+    if (block_size < 64 || size < (Py_ssize_t)sizeof(store_header) + block_size + (Py_ssize_t)sizeof(store_slot)) {
+        Py_DECREF(name);
+        PyErr_SetString(PyExc_ValueError, "Size must fit at least one block of at least 64 bytes");
+        return NULL;
+    }
+    block_size = (block_size + 63) & ~(Py_ssize_t)63;
+
+    int fd = shm_open(PyBytes_AS_STRING(name), O_CREAT | O_RDWR, 0600);
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, name);
+        Py_DECREF(name);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size == 0 && ftruncate(fd, size) < 0)) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, name);
+        close(fd);
+        Py_DECREF(name);
+        return NULL;
+    }
+    // An existing segment keeps the geometry it was created with
+    if (st.st_size > 0) {
+        size = st.st_size;
+    }
+    char* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, name);
+        Py_DECREF(name);
+        return NULL;
+    }
+
+    store_header* header = (store_header*)map;
+    uint64_t magic = 0;
+    if (atomic_compare_exchange_strong(&header->magic, &magic, 1)) {
+        header->block_size = block_size;
+        header->nslots = (size - sizeof(store_header)) / (block_size + sizeof(store_slot));
+        atomic_store(&header->clock, 0);
+        atomic_store_explicit(&header->magic, STORE_MAGIC, memory_order_release);
+    } else {
+        // Another process is initializing it
+        while ((magic = atomic_load_explicit(&header->magic, memory_order_acquire)) == 1) {
+            sched_yield();
+        }
+    }
+    if (atomic_load_explicit(&header->magic, memory_order_acquire) != STORE_MAGIC ||
+        sizeof(store_header) + header->nslots * (header->block_size + sizeof(store_slot)) > (uint64_t)size) {
+        munmap(map, size);
+        Py_DECREF(name);
+        PyErr_SetString(PyExc_ValueError, "Shared memory segment is not a fragment store");
+        return NULL;
+    }
+
+    FragmentStoreObject* self = (FragmentStoreObject*)type->tp_alloc(type, 0);
+    if (!self) {
+        munmap(map, size);
+        Py_DECREF(name);
+        return NULL;
+    }
+    self->map = map;
+    self->map_size = size;
+    self->header = header;
+    self->slots = (store_slot*)(map + sizeof(store_header));
+    self->blocks = (char*)(self->slots + header->nslots);
+    self->name = name;
+    return (PyObject*)self;
+}
+
+static void FragmentStore_dealloc(PyObject* obj) {
+    FragmentStoreObject* self = (FragmentStoreObject*)obj;
+    munmap(self->map, self->map_size);
+    Py_XDECREF(self->name);
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free(obj);
+    Py_DECREF(type);
+}
+
+// Whether a WRITING slot's writer is gone, leaving the slot unfinished
+static int store_writer_dead(uint64_t state) {
+    pid_t pid = (pid_t)(state >> 2);
+    return pid != getpid() && kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+static PyObject* FragmentStore_get(FragmentStoreObject* self, PyObject* key) {
+    uint64_t hash;
+    if (store_key(key, &hash) < 0) {
+        return NULL;
+    }
+    // A key is stored again in another slot while its own is being written, so take the newest copy
+    uint64_t nslots = self->header->nslots;
+    store_slot* slot = NULL;
+    uint64_t newest = 0;
+    for (int probe = 0; probe < STORE_PROBES && probe < (int)nslots; probe++) {
+        store_slot* candidate = &self->slots[(hash + probe) % nslots];
+        uint64_t stamp = atomic_load_explicit(&candidate->stamp, memory_order_relaxed);
+        if (SLOT_STATE(atomic_load_explicit(&candidate->state, memory_order_acquire)) == SLOT_READY &&
+            candidate->key == hash && (!slot || stamp > newest)) {
+            slot = candidate;
+            newest = stamp;
+        }
+    }
+    if (!slot) {
+        Py_RETURN_NONE;
+    }
+    PyTypeObject* type = TYPE_STATE(Py_TYPE(self))->HTML_Type;
+    const char* block = self->blocks + (slot - self->slots) * self->header->block_size;
+    for (int retry = 0; retry < STORE_READ_RETRIES; retry++) {
+        uint64_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+        // Torn reads are caught below, the length just has to stay in the block
+        uint64_t length = slot->length;
+        if (SLOT_STATE(state) != SLOT_READY || slot->key != hash) {
+            Py_RETURN_NONE;  // evicted and reused since
+        }
+        if (length >= self->header->block_size) {
+            continue;
+        }
+        HTMLObject* copy = (HTMLObject*)HTMLObjectFromStringAndSize(type, block, length);
+        if (!copy) {
+            return NULL;
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->state, memory_order_relaxed) == state) {
+            atomic_store_explicit(&slot->stamp, atomic_fetch_add(&self->header->clock, 1), memory_order_relaxed);
+            return (PyObject*)copy;
+        }
+        Py_DECREF(copy);  // rewritten while copying
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* FragmentStore_put(FragmentStoreObject* self, PyObject* args) {
+    PyObject *key, *value;
+    if (!PyArg_ParseTuple(args, "OO!", &key, TYPE_STATE(Py_TYPE(self))->HTML_Type, &value)) {
+        return NULL;
+    }
+    uint64_t hash;
+    if (store_key(key, &hash) < 0) {
+        return NULL;
+    }
+    HTMLObject* html = (HTMLObject*)value;
+    if ((uint64_t)html->size + 1 > self->header->block_size) {
+        Py_RETURN_FALSE;
+    }
+    uint64_t nslots = self->header->nslots;
+    // Try the slot already holding the key, then empty slots, then the oldest unpinned ones
+    for (int attempt = 0; attempt < STORE_PROBES; attempt++) {
+        store_slot* victim = NULL;
+        uint64_t victim_state = 0;
+        int victim_rank = 3;
+        uint64_t victim_stamp = UINT64_MAX;
+        for (int probe = 0; probe < STORE_PROBES && probe < (int)nslots; probe++) {
+            store_slot* slot = &self->slots[(hash + probe) % nslots];
+            uint64_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+            uint64_t stamp = atomic_load_explicit(&slot->stamp, memory_order_relaxed);
+            int rank;
+            if (SLOT_STATE(state) == SLOT_READY && slot->key == hash) {
+                rank = 0;
+            } else if (state == SLOT_EMPTY || (SLOT_STATE(state) == SLOT_WRITING && store_writer_dead(state))) {
+                rank = 1;
+            } else if (SLOT_STATE(state) == SLOT_READY) {
+                rank = 2;
+            } else {
+                continue;  // being written
+            }
+            if (rank < victim_rank || (rank == victim_rank && stamp < victim_stamp)) {
+                victim = slot;
+                victim_state = state;
+                victim_rank = rank;
+                victim_stamp = stamp;
+            }
+        }
+        if (!victim) {
+            break;
+        }
+        if (!atomic_compare_exchange_strong_explicit(&victim->state, &victim_state,
+                                                     SLOT_WORD(getpid(), SLOT_WRITING),
+                                                     memory_order_acquire, memory_order_relaxed)) {
+            continue;  // lost a race with another reader or writer
+        }
+        char* block = self->blocks + (victim - self->slots) * self->header->block_size;
+        memcpy(block, html->data, html->size);
+        block[html->size] = '\0';
+        victim->key = hash;
+        victim->length = html->size;
+        uint64_t version = atomic_fetch_add(&self->header->clock, 1);
+        atomic_store_explicit(&victim->stamp, version, memory_order_relaxed);
+        atomic_store_explicit(&victim->state, SLOT_WORD(version + 1, SLOT_READY), memory_order_release);
+        Py_RETURN_TRUE;
+    }
+    Py_RETURN_FALSE;
+}
+
+static PyObject* FragmentStore_unlink(FragmentStoreObject* self, PyObject* Py_UNUSED(ignored)) {
+    if (shm_unlink(PyBytes_AS_STRING(self->name)) < 0) {
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, self->name);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef FragmentStore_methods[] = {
+    {"get", (PyCFunction)FragmentStore_get, METH_O, "Return a copy of the fragment stored for key as a new HTML object, or None"},
+    {"put", (PyCFunction)FragmentStore_put, METH_VARARGS, "Store an HTML fragment for key, return whether it was stored"},
+    {"unlink", (PyCFunction)FragmentStore_unlink, METH_NOARGS, "Remove the shared memory segment's name"},
+    {NULL} // Sentinel
+};
+
+static PyType_Slot FragmentStore_slots[] = {
+    {Py_tp_doc, "Fragment cache shared between processes through shared memory"},
+    {Py_tp_new, FragmentStore_new},
+    {Py_tp_dealloc, FragmentStore_dealloc},
+    {Py_tp_methods, FragmentStore_methods},
+    {0, NULL},
+};
+
+static PyType_Spec FragmentStore_spec = {
+    .name = "fasttag.FragmentStore",
+    .basicsize = sizeof(FragmentStoreObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = FragmentStore_slots,
+};
+#endif
+
+#define IS_SKIPPED_CHILD(st, item) ((st)->iterate_children && ((item) == Py_None || (item) == Py_False))
+
+// Frees a partial render after an error. Render helpers signal errors by
+// leaving *result_obj NULL with an exception set.
+static void discard_result(HTMLObject** result_obj) {
+    Py_DECREF(*result_obj);
+    *result_obj = NULL;
 }
 
-void reserve(int new_size, HTMLObject** result_obj, int *reserved, char** result) {
+void reserve(fasttag_state* st, Py_ssize_t new_size, HTMLObject** result_obj, Py_ssize_t *reserved, char** result) {
     if (new_size > *reserved) {
-        *reserved = 4 * new_size;
-        // printf("Resizing to %d\n", *reserved);
-        *result_obj = (HTMLObject*)PyObject_Realloc(
-            *result_obj, _PyObject_SIZE(&HTML_Type) +  *reserved);
-        if (!*result_obj) {
-            printf("Failed to allocate memory for data\n");
+        if (new_size > MAX_HTML_SIZE) {
+            PyErr_SetString(PyExc_OverflowError, "HTML too large");
+            discard_result(result_obj);
+            return;
+        }
+        char in_arena = (*result_obj)->owner && Arena_Check((*result_obj)->owner);
+#ifdef FASTTAG_HAVE_SPILL
+        if ((*result_obj)->mapped) {
+            // Page cache backed, so grow less aggressively than on the heap
+            FASTTAG_PROBE(reserve, *reserved, grown_capacity(new_size, 2));
+            *reserved = grown_capacity(new_size, 2);
+            if (HTML_remap(*result_obj, *reserved) < 0) {
+                discard_result(result_obj);
+                return;
+            }
+            *result = (*result_obj)->data;
+            return;
+        }
+        if (st->spill_threshold > 0 && grown_capacity(new_size, 4) > st->spill_threshold) {
+            FASTTAG_PROBE(spill, *reserved, grown_capacity(new_size, 2));
+            // A render in an arena leaves it, so arenas don't grow past the threshold either
+            ArenaObject* arena = in_arena ? arena_release(*result_obj) : NULL;
+            HTMLObject* spilled = HTML_spill(*result_obj, st->spill_dir, *reserved, grown_capacity(new_size, 2));
+            Py_XDECREF(arena);
+            if (!spilled) {
+                discard_result(result_obj);
+                return;
+            }
+            *result_obj = spilled;
+            *reserved = grown_capacity(new_size, 2);
+            *result = (*result_obj)->data;
+            return;
+        }
+#endif
+        if (in_arena) {
+            Py_ssize_t capacity = grown_capacity(new_size, 2);
+            FASTTAG_PROBE(reserve, *reserved, capacity);
+            if (arena_grow(*result_obj, capacity) < 0) {
+                PyErr_NoMemory();
+                discard_result(result_obj);
+                return;
+            }
+            *reserved = capacity;
+            *result = (*result_obj)->data;
+            return;
+        }
+        Py_ssize_t capacity = grown_capacity(new_size, 4);
+        FASTTAG_PROBE(reserve, *reserved, capacity);
+        HTMLObject* grown = HTML_realloc(*result_obj, capacity);
+        if (!grown && capacity > new_size) {
+            // Retry without headroom
+            capacity = new_size;
+            grown = HTML_realloc(*result_obj, capacity);
+        }
+        if (!grown) {
             PyErr_SetString(PyExc_MemoryError, "Failed to allocate memory for data");
+            discard_result(result_obj);
             return;
         }
+        *result_obj = grown;
+        *reserved = capacity;
         *result = (*result_obj)->data;
     }
 }
 
-void append_bytes(int* l, const char* item, int size, int indent, int *reserved, HTMLObject** result_obj, char** result) {
-    reserve(*l + size * (indent >= 1 ? indent : 1) + 22, result_obj, reserved, result);
+void append_bytes(fasttag_state* st, Py_ssize_t* l, const char* item, Py_ssize_t size, int indent, Py_ssize_t *reserved, HTMLObject** result_obj, char** result) {
+    reserve(st, size_add(*l, size_add(size_mul(size, FT_RAW_MAX(1, indent)), 22)), result_obj, reserved, result);
     if (!*result_obj) {
         return;
     }
-    if (indent >= 0) {
-        for (int j = 0; j < size; j++) {
-            (*result)[(*l)++] = item[j];
-            if (item[j] == '\n') {
-                for (int k = 0; k < indent; k++) {
-                    (*result)[(*l)++] = ' ';
-                }
+    *l += ft_write_raw(*result + *l, item, size, indent);
+}
+
+void append_item_to_html(fasttag_state* st, Py_ssize_t* l, PyObject* item, int indent, char disable_indent, int i,
+     HTMLObject** result_obj, Py_ssize_t *reserved, char** result);
+
+// Renders the items of an iterable child one by one, the same way as a tuple.
+void append_iterable_to_html(fasttag_state* st, Py_ssize_t* l, PyObject* item, int indent, char disable_indent, int i,
+     HTMLObject** result_obj, Py_ssize_t *reserved, char** result)
+{
+    PyObject* iter = PyObject_GetIter(item);
+    if (!iter) {
+        discard_result(result_obj);
+        return;
+    }
+    PyObject* subitem;
+    while ((subitem = PyIter_Next(iter))) {
+        if (!IS_SKIPPED_CHILD(st, subitem)) {
+            reserve(st, *l + 23, result_obj, reserved, result);
+            if (*result_obj) {
+                (*result)[(*l)++] = '\n';
+                append_item_to_html(st, l, subitem, indent, disable_indent, i, result_obj, reserved, result);
             }
         }
+        Py_DECREF(subitem);
+        if (!*result_obj) {
+            Py_DECREF(iter);
+            return;
+        }
+    }
+    Py_DECREF(iter);
+    if (PyErr_Occurred()) {
+        discard_result(result_obj);
+    }
+}
+
+// Looks up the rendering protocol of item's type. Methods defined on the
+// type (or a base) are cached. Types that define neither are only cached as
+// having none when their instances can't have them either; instances with a
+// __dict__, or of types with __getattr__ or __getattribute__ that may make
+// them up, are asked on every call.
+static int item_protocol(fasttag_state* st, PyObject* item) {
+    PyTypeObject* type = Py_TYPE(item);
+    protocol_entry* entry = &st->protocol_cache[((uintptr_t)type >> 4) % PROTOCOL_CACHE_SIZE];
+    int protocol;
+    if (entry->type == type && entry->version_tag == type->tp_version_tag &&
+        PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)) {
+        protocol = entry->protocol;
     } else {
-        for (int j = 0; j < size; j++) {
-            (*result)[(*l)++] = item[j];
+        protocol = PyObject_HasAttr((PyObject*)type, st->str_html) ? PROTOCOL_HTML
+                 : PyObject_HasAttr((PyObject*)type, st->str_ft) ? PROTOCOL_FT
+                 : type->tp_getattro != PyObject_GenericGetAttr || type->tp_dictoffset != 0 ? PROTOCOL_INSTANCE
+                 : PROTOCOL_NONE;
+        // The lookups above assign the type a version tag, unless they've run out
+        if (PyType_HasFeature(type, Py_TPFLAGS_VALID_VERSION_TAG)) {
+            entry->type = type;
+            entry->version_tag = type->tp_version_tag;
+            entry->protocol = protocol;
         }
     }
+    if (protocol == PROTOCOL_INSTANCE) {
+        return PyObject_HasAttr(item, st->str_html) ? PROTOCOL_HTML
+             : PyObject_HasAttr(item, st->str_ft) ? PROTOCOL_FT
+             : PROTOCOL_NONE;
+    }
+    return protocol;
 }
 
-void append_item_to_html(int* l, PyObject* item, int indent, char disable_indent, int i,
-     HTMLObject** result_obj, int *reserved, char** result)
+void append_item_to_html(fasttag_state* st, Py_ssize_t* l, PyObject* item, int indent, char disable_indent, int i,
+     HTMLObject** result_obj, Py_ssize_t *reserved, char** result)
 {
     if (PyUnicode_Check(item)) {
-        if (indent < 0 && i > 1) {
-            (*result)[(*l)++] = ' ';
+        Py_ssize_t size;
+        const char* item_str = PyUnicode_AsUTF8AndSize(item, &size);
+        if (!item_str) {
+            discard_result(result_obj);
+            return;
         }
-                    const char* item_str = PyUnicode_AsUTF8(item);
-        int size = strlen(item_str);
-        reserve(*l + size*(indent >=4 ? indent : 4) + 22, result_obj, reserved, result);
+        reserve(st, size_add(*l, size_add(size_mul(size, FT_TEXT_MAX(1, indent)), 22)), result_obj, reserved, result);
         if (!*result_obj) {
             return;
         }
-
-        if (indent > 0 && !disable_indent) {
-            for (int j = 0; item_str[j] != '\0'; j++) {
-                if (item_str[j] == '<') {
-                    (*result)[(*l)++] = '&';
-                    (*result)[(*l)++] = 'l';
-                    (*result)[(*l)++] = 't';
-                    (*result)[(*l)++] = ';';
-                } else if (item_str[j] == '&') {
-                    (*result)[(*l)++] = '&';
-                    (*result)[(*l)++] = 'a';
-                    (*result)[(*l)++] = 'm';
-                    (*result)[(*l)++] = 'p';
-                    (*result)[(*l)++] = ';';
-                } else if (item_str[j] == '\n') {
-                    (*result)[(*l)++] = '\n';
-                    for (int k = 0; k < indent; k++) {
-                        (*result)[(*l)++] = ' ';
-                    }
-                } else {
-                    (*result)[(*l)++] = item_str[j];
-                }
-            }
-        } else {
-            for (int j = 0; item_str[j] != '\0'; j++) {
-                if (item_str[j] == '<') {
-                    (*result)[(*l)++] = '&';
-                    (*result)[(*l)++] = 'l';
-                    (*result)[(*l)++] = 't';
-                    (*result)[(*l)++] = ';';
-                } else if (item_str[j] == '&') {
-                    (*result)[(*l)++] = '&';
-                    (*result)[(*l)++] = 'a';
-                    (*result)[(*l)++] = 'm';
-                    (*result)[(*l)++] = 'p';
-                    (*result)[(*l)++] = ';';
-                } else {
-                    (*result)[(*l)++] = item_str[j];
-                }
-            }
-        } 
+        ft_child child = {FT_CHILD_TEXT, item_str, size, 0, 0};
+        *l += ft_write_child_value(*result + *l, &child, i, indent, disable_indent);
     } else if (PyBytes_Check(item) || HTMLObject_Check(item)) {
         char *item_str;
-        int size;
+        Py_ssize_t size;
         if(PyBytes_Check(item)) {
             item_str = PyBytes_AsString(item);
             size = PyBytes_Size(item);
@@ -543,325 +1884,1642 @@ void append_item_to_html(int* l, PyObject* item, int indent, char disable_indent
             item_str = html_obj->data;
             size = html_obj->size;
         }
-        append_bytes(l, item_str, size, indent, reserved, result_obj, result);
+        append_bytes(st, l, item_str, size, indent, reserved, result_obj, result);
     } else if (PyLong_Check(item)) {
-        if (indent < 0 && i > 1) {
-            (*result)[(*l)++] = ' ';
+        int overflow;
+        long long long_value = PyLong_AsLongLongAndOverflow(item, &overflow);
+        if (overflow) {
+            // Too large for sprintf, let Python format it
+            FASTTAG_PROBE(str_fallback, Py_TYPE(item)->tp_name);
+            PyObject* item_str = PyObject_Str(item);
+            if (!item_str) {
+                discard_result(result_obj);
+                return;
+            }
+            append_item_to_html(st, l, item_str, indent, disable_indent, i, result_obj, reserved, result);
+            Py_DECREF(item_str);
+            return;
         }
-        long long_value = PyLong_AsLong(item);
-        char long_str[20];
-        sprintf(long_str, "%ld", long_value);
-        char *long_strp = long_str;
-        while (*long_strp) {
-            (*result)[(*l)++] = *(long_strp++);
+        reserve(st, *l + 48, result_obj, reserved, result);
+        if (!*result_obj) {
+            return;
         }
+        ft_child child = {FT_CHILD_LONG, NULL, 0, long_value, 0};
+        *l += ft_write_child_value(*result + *l, &child, i, indent, disable_indent);
     } else if (PyFloat_Check(item)) {
-        if (indent < 0 && i > 1) {
-            (*result)[(*l)++] = ' ';
-        }
-        double double_value = PyFloat_AsDouble(item);
-        char double_str[20];
-        sprintf(double_str, "%g", double_value);
-        char *double_strp = double_str;
-        while (*double_strp) {
-            (*result)[(*l)++] = *(double_strp++);
+        reserve(st, *l + 48, result_obj, reserved, result);
+        if (!*result_obj) {
+            return;
         }
+        ft_child child = {FT_CHILD_DOUBLE, NULL, 0, 0, PyFloat_AsDouble(item)};
+        *l += ft_write_child_value(*result + *l, &child, i, indent, disable_indent);
     } else if (PyTuple_Check(item)) {
         Py_ssize_t num_args = PyTuple_Size(item);
         for (Py_ssize_t j = 0; j < num_args; j++) {
-            (*result)[(*l)++] = '\n';
             PyObject* subitem = PyTuple_GetItem(item, j);
-            append_item_to_html(l, subitem, indent, disable_indent, i, result_obj, reserved, result);
+            if (IS_SKIPPED_CHILD(st, subitem)) {
+                continue;
+            }
+            reserve(st, *l + 23, result_obj, reserved, result);
+            if (!*result_obj) {
+                return;
+            }
+            (*result)[(*l)++] = '\n';
+            append_item_to_html(st, l, subitem, indent, disable_indent, i, result_obj, reserved, result);
             if (!*result_obj) {
                 return;
             }
         }
-    } else if (PyObject_HasAttrString(item, "__html__")) {
-        PyObject* html = PyObject_CallMethod(item, "__html__", NULL);
-        if (!html) {
-            return;
+    } else {
+        int protocol = item_protocol(st, item);
+        if (protocol == PROTOCOL_HTML) {
+            FASTTAG_PROBE(html_call, Py_TYPE(item)->tp_name);
+            PyObject* html = PyObject_VectorcallMethod(st->str_html, &item, 1 | PY_VECTORCALL_ARGUMENTS_OFFSET, NULL);
+            if (!html) {
+                discard_result(result_obj);
+                return;
+            }
+            // Markup as str, or already encoded as bytes or HTML
+            const char* item_str;
+            Py_ssize_t size;
+            if (PyUnicode_Check(html)) {
+                item_str = PyUnicode_AsUTF8AndSize(html, &size);
+            } else if (PyBytes_Check(html)) {
+                item_str = PyBytes_AS_STRING(html);
+                size = PyBytes_GET_SIZE(html);
+            } else if (HTMLObject_Check(html)) {
+                item_str = ((HTMLObject*)html)->data;
+                size = ((HTMLObject*)html)->size;
+            } else {
+                PyErr_Format(PyExc_TypeError, "__html__ returned non-string (type %.200s)", Py_TYPE(html)->tp_name);
+                item_str = NULL;
+            }
+            if (!item_str) {
+                Py_DECREF(html);
+                discard_result(result_obj);
+                return;
+            }
+            append_bytes(st, l, item_str, size, indent, reserved, result_obj, result);
+            Py_DECREF(html);
+        } else if (protocol == PROTOCOL_FT) {
+            FASTTAG_PROBE(ft_call, Py_TYPE(item)->tp_name);
+            PyObject* ft = PyObject_VectorcallMethod(st->str_ft, &item, 1 | PY_VECTORCALL_ARGUMENTS_OFFSET, NULL);
+            if (!ft) {
+                discard_result(result_obj);
+                return;
+            }
+            append_item_to_html(st, l, ft, indent, disable_indent, i, result_obj, reserved, result);
+            Py_DECREF(ft);
+        } else if (st->iterate_children && Py_TYPE(item)->tp_iter && !PyDict_Check(item)) {
+            append_iterable_to_html(st, l, item, indent, disable_indent, i, result_obj, reserved, result);
+        } else {
+            FASTTAG_PROBE(str_fallback, Py_TYPE(item)->tp_name);
+            item = PyObject_Str(item);
+            if (!item) {
+                discard_result(result_obj);
+                return;
+            }
+            append_item_to_html(st, l, item, indent, disable_indent, i, result_obj, reserved, result);
+            Py_DECREF(item);
+        }
+    }
+}
+
+// Writes the attributes of a start tag from keyword arguments, with extra
+// bytes reserved after each.
+static void append_attributes(fasttag_state* st, Py_ssize_t* l, PyObject* kwargs, Py_ssize_t extra,
+                              HTMLObject** result_obj, Py_ssize_t* reserved, char** result) {
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    while (kwargs && PyDict_Next(kwargs, &pos, &key, &value)) {
+        // if value is false, continue
+        if (PyBool_Check(value) && value == Py_False) {
+            continue;
+        }
+
+        ft_attr attr;
+        Py_ssize_t name_length;
+        attr.name = PyUnicode_AsUTF8AndSize(key, &name_length);
+        if (!attr.name) {
+            discard_result(result_obj);
+            return;
+        }
+        attr.name_length = name_length;
+        attr.string_length = 0;
+        PyObject* converted = NULL;
+        int overflow = 0;
+        if (PyBool_Check(value)) {
+            attr.kind = FT_ATTR_TRUE;
+        } else if (PyLong_Check(value) &&
+                   (attr.long_value = PyLong_AsLongLongAndOverflow(value, &overflow), !overflow)) {
+            attr.kind = FT_ATTR_LONG;
+        } else if (PyFloat_Check(value)) {
+            attr.kind = FT_ATTR_DOUBLE;
+            attr.double_value = PyFloat_AsDouble(value);
+        } else {
+            // convert to string if necessary
+            if (!PyUnicode_Check(value)) {
+                FASTTAG_PROBE(str_fallback, Py_TYPE(value)->tp_name);
+                value = converted = PyObject_Str(value);
+                if (!value) {
+                    discard_result(result_obj);
+                    return;
+                }
+            }
+            attr.kind = FT_ATTR_STRING;
+            Py_ssize_t string_length;
+            attr.string = PyUnicode_AsUTF8AndSize(value, &string_length);
+            if (!attr.string) {
+                Py_XDECREF(converted);
+                discard_result(result_obj);
+                return;
+            }
+            attr.string_length = string_length;
+        }
+        // &quot; is the longest escape
+        Py_ssize_t attr_max = size_add(size_mul(attr.string_length, 6), name_length + 4 + FT_NUMBER_MAX);
+        reserve(st, size_add(*l, size_add(attr_max, extra)), result_obj, reserved, result);
+        if (*result_obj) {
+            *l += ft_write_attr(*result + *l, &attr);
+        }
+        Py_XDECREF(converted);
+        if (!*result_obj) {
+            return;
+        }
+    }
+}
+
+// Initial buffer size for tags that haven't been rendered yet
+#define DEFAULT_SIZE_HINT 200
+
+// Largest size hint: bigger renders grow their buffer through reserve() anyway,
+// and one huge render mustn't make the following small ones allocate megabytes.
+#define MAX_SIZE_HINT 4096
+
+// Moves a size hint a quarter of the way towards the size of the latest
+// render, up to MAX_SIZE_HINT.
+#define UPDATE_SIZE_HINT(hint, size) \
+    (*(hint) += ((Py_ssize_t)((size) < MAX_SIZE_HINT ? (size) : MAX_SIZE_HINT) - *(hint)) / 4)
+
+// Size hint for a tag rendered through tag(), from a hash of the tag name.
+// Colliding names just share an estimate.
+static Py_ssize_t* generic_size_hint(fasttag_state* st, const char* tag) {
+    unsigned int hash = 5381;
+    while (*tag) {
+        hash = hash * 33 + (unsigned char)*tag++;
+    }
+    Py_ssize_t* hint = &st->generic_size_hints[hash % GENERIC_SIZE_HINTS];
+    if (*hint == 0) {
+        *hint = DEFAULT_SIZE_HINT;
+    }
+    return hint;
+}
+
+// Whether a child renders to pure ASCII, as far as is known without
+// rendering it. Int subclasses may format themselves when too large.
+static int known_ascii(PyObject* item) {
+    if (PyUnicode_Check(item)) {
+        return PyUnicode_IS_ASCII(item);
+    }
+    if (HTMLObject_Check(item)) {
+        return ((HTMLObject*)item)->ascii == ASCII_YES;
+    }
+    if (PyTuple_Check(item)) {
+        for (Py_ssize_t j = 0; j < PyTuple_GET_SIZE(item); j++) {
+            if (!known_ascii(PyTuple_GET_ITEM(item, j))) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return PyLong_CheckExact(item) || PyBool_Check(item) || PyFloat_Check(item);
+}
+
+// Same for the tag name and attributes of an element. Attribute values other
+// than numbers and strings are formatted with str(), so they're left unknown.
+static int known_ascii_markup(const char* tag, PyObject* kwargs, const ft_attr* attrs, size_t num_attrs) {
+    if (!ft_is_ascii(tag, strlen(tag))) {
+        return 0;
+    }
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    while (kwargs && PyDict_Next(kwargs, &pos, &key, &value)) {
+        if (!PyUnicode_Check(key) || !PyUnicode_IS_ASCII(key) ||
+            !(PyUnicode_Check(value) ? PyUnicode_IS_ASCII(value)
+                                     : PyLong_CheckExact(value) || PyBool_Check(value) || PyFloat_Check(value))) {
+            return 0;
+        }
+    }
+    for (size_t j = 0; j < num_attrs; j++) {
+        if (!ft_is_ascii(attrs[j].name, attrs[j].name_length) ||
+            (attrs[j].kind == FT_ATTR_STRING && !ft_is_ascii(attrs[j].string, attrs[j].string_length))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Renders an element from its children items[first:num_items], with
+// attributes from either keyword arguments or descriptors (the C API).
+// size_hint is the running estimate of the tag's output size, used for the
+// initial allocation and updated with the size of this render.
+static PyObject* render_element(fasttag_state* st, const char* tag, PyObject* const* items, Py_ssize_t first,
+                                Py_ssize_t num_items, PyObject* kwargs, const ft_attr* attrs, size_t num_attrs,
+                                Py_ssize_t* size_hint, const render_room* room) {
+    // Allocate memory for the new string, with some headroom over the estimate
+    // so that renders a bit larger than usual don't need to grow it
+    Py_ssize_t reserved = *size_hint + *size_hint / 4 + 32;
+    if (st->spill_threshold > 0 && reserved > st->spill_threshold) {
+        // Renders that large start small and spill once they get there
+        reserved = st->spill_threshold;
+    }
+    HTMLObject *result_obj = render_alloc(st, reserved, room);
+    if (!result_obj) {
+        return PyErr_NoMemory();
+    }
+    char* result = result_obj->data;
+    int indent = st->indent;
+    int ascii = known_ascii_markup(tag, kwargs, attrs, num_attrs);
+
+    // Copy the tag and attributes into the new string
+    Py_ssize_t l = 0;
+    result[l++] = '<';
+    Py_ssize_t extra = 22 + (indent >= 0 ? indent : 0);
+    reserve(st, size_add(strlen(tag) + l, extra), &result_obj, &reserved, &result);
+    if (!result_obj) {
+        return NULL;
+    }
+    char *tagp = (char*)tag;
+    while (*tagp) {
+        result[l++] = *(tagp++);
+    }
+
+    append_attributes(st, &l, kwargs, extra, &result_obj, &reserved, &result);
+    for (size_t j = 0; result_obj && j < num_attrs; j++) {
+        reserve(st, size_add(l, size_add(ft_attr_max(&attrs[j]), extra)), &result_obj, &reserved, &result);
+        if (result_obj) {
+            l += ft_write_attr(result + l, &attrs[j]);
+        }
+    }
+    if (!result_obj) {
+        return NULL;
+    }
+    
+    result[l++] = '>';
+
+    Py_ssize_t num_children = num_items - first;
+    PyObject* only_child = num_children == 1 ? items[first] : NULL;
+    if (st->iterate_children) {
+        // Skipped children don't count
+        num_children = 0;
+        for (Py_ssize_t i = first; i < num_items; i++) {
+            PyObject* item = items[i];
+            if (!IS_SKIPPED_CHILD(st, item)) {
+                num_children++;
+                only_child = item;
+            }
+        }
+    }
+    // The core decides the layout from what the only child is; other objects count as numbers
+    ft_child only = {FT_CHILD_TEXT, NULL, 0, 0, 0};
+    const ft_child* only_layout = NULL;
+    if (num_children == 1 && PyUnicode_Check(only_child)) {
+        Py_ssize_t size;
+        only.data = PyUnicode_AsUTF8AndSize(only_child, &size);
+        if (!only.data) {
+            discard_result(&result_obj);
+            return NULL;
+        }
+        only.length = size;
+        only_layout = &only;
+    } else if (num_children == 1 && (PyBytes_Check(only_child) || HTMLObject_Check(only_child))) {
+        only.kind = FT_CHILD_RAW;
+        only_layout = &only;
+    }
+    char disable_indent = ft_children_inline(tag, num_children, only_layout);
+
+    for (Py_ssize_t i = first; i < num_items; i++) {
+        PyObject* item = items[i];
+        if (IS_SKIPPED_CHILD(st, item)) {
+            continue;
+        }
+        reserve(st, size_add(l, extra), &result_obj, &reserved, &result);
+        if (!result_obj) {
+            return NULL;
+        }
+        l += ft_write_child_indent(result + l, indent, disable_indent);
+        append_item_to_html(st, &l, item, indent, disable_indent, i, &result_obj, &reserved, &result);
+        if (!result_obj) {
+            return NULL;
+        }
+        ascii = ascii && known_ascii(item);
+    }
+    reserve(st, size_add(l, strlen(tag) + 4), &result_obj, &reserved, &result);
+    if (!result_obj) {
+        return NULL;
+    }
+    if (!ft_is_self_closing(tag)) {
+        l += ft_write_children_end(result + l, indent, disable_indent);
+
+        result[l++] = '<';
+        result[l++] = '/';
+        char *tag2 = (char*)tag;
+        while (*tag2) {
+            result[l++] = *(tag2++);
+        }
+        result[l++] = '>';
+    }
+    result_obj->size = l;
+    result[l] = '\0';
+    result_obj = HTMLObjectShrink(result_obj, l);
+    result_obj->ascii = ascii ? ASCII_YES : ASCII_UNKNOWN;
+    UPDATE_SIZE_HINT(size_hint, l);
+
+    return (PyObject *)result_obj;
+}
+
+// size_hint as in render_element
+static PyObject* fasttag_tag_render(fasttag_state* st, const char* tag, PyObject* args, char skip_first, PyObject* kwargs,
+                                    Py_ssize_t* size_hint) {
+    // Process args
+    Py_ssize_t num_args = PyTuple_Size(args);
+    if (skip_first && num_args < 1) {
+        // throw an exception
+        PyErr_SetString(PyExc_TypeError, "At least one argument is required (tag)");
+        return NULL;
+    }
+    return render_element(st, tag, &PyTuple_GET_ITEM(args, 0), skip_first, num_args, kwargs, NULL, 0, size_hint, NULL);
+}
+
+// Interning of small leaf elements like Td("0") or Span("N/A", _class="badge"):
+// renders whose children and attribute values are all short strings, ints,
+// floats or bools are cached in a direct-mapped table keyed by a hash of the
+// tag, arguments and settings, and the same HTML object is returned again.
+// Off until set_intern is called with a table size.
+#define INTERN_MAX_TAG 16
+#define INTERN_MAX_ITEMS 8
+#define INTERN_MAX_LENGTH 64
+
+struct intern_entry {
+    Py_hash_t hash;
+    char tag[INTERN_MAX_TAG];
+    int indent;
+    int iterate_children;
+    PyObject* args;    // the call's arguments, immutable as only leaf values are interned
+    PyObject* kwargs;  // the call's own dict, or NULL
+    char skip_first;
+    PyObject* html;    // NULL for an empty slot
+};
+
+static void intern_clear(intern_entry* entry) {
+    Py_CLEAR(entry->args);
+    Py_CLEAR(entry->kwargs);
+    Py_CLEAR(entry->html);
+}
+
+// Hashes a leaf value, -1 if it can't be interned. The type is part of the
+// hash, as 1, 1.0 and True are equal but render differently.
+static Py_hash_t intern_value_hash(PyObject* value) {
+    PyTypeObject* type = Py_TYPE(value);
+    if (type == &PyUnicode_Type) {
+        if (PyUnicode_GET_LENGTH(value) > INTERN_MAX_LENGTH) {
+            return -1;
+        }
+    } else if (type != &PyLong_Type && type != &PyFloat_Type && type != &PyBool_Type) {
+        return -1;
+    }
+    Py_hash_t hash = PyObject_Hash(value);
+    if (hash == -1) {
+        PyErr_Clear();
+        return -1;
+    }
+    return (hash ^ (Py_hash_t)(uintptr_t)type) & PY_SSIZE_T_MAX;
+}
+
+static int intern_values_equal(PyObject* a, PyObject* b) {
+    if (a == b) {
+        return 1;
+    }
+    if (Py_TYPE(a) != Py_TYPE(b)) {
+        return 0;
+    }
+    if (PyFloat_CheckExact(a)) {
+        // Bitwise, as 0.0 == -0.0 but they render differently, and NaN != NaN
+        double x = PyFloat_AS_DOUBLE(a), y = PyFloat_AS_DOUBLE(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    int equal = PyObject_RichCompareBool(a, b, Py_EQ);
+    if (equal < 0) {
+        PyErr_Clear();
+        return 0;
+    }
+    return equal;
+}
+
+// Returns the slot for the call and sets *hash, or returns NULL if it can't be
+// interned. *hit is set if the slot already holds its HTML.
+static intern_entry* intern_lookup(fasttag_state* st, const char* tag, PyObject* args, char skip_first, PyObject* kwargs,
+                                   Py_hash_t* hash_out, int* hit) {
+    *hit = 0;
+    size_t tag_length = strlen(tag);
+    Py_ssize_t num_args = PyTuple_GET_SIZE(args);
+    Py_ssize_t num_kwargs = kwargs ? PyDict_GET_SIZE(kwargs) : 0;
+    if (tag_length >= INTERN_MAX_TAG || num_args - skip_first + num_kwargs > INTERN_MAX_ITEMS) {
+        return NULL;
+    }
+    Py_hash_t hash = (Py_hash_t)(st->indent * 31 + st->iterate_children);
+    for (size_t j = 0; j < tag_length; j++) {
+        hash = hash * 33 + (unsigned char)tag[j];
+    }
+    for (Py_ssize_t i = skip_first; i < num_args; i++) {
+        Py_hash_t item_hash = intern_value_hash(PyTuple_GET_ITEM(args, i));
+        if (item_hash == -1) {
+            return NULL;
+        }
+        hash = (hash * 1000003) ^ item_hash;
+    }
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    while (kwargs && PyDict_Next(kwargs, &pos, &key, &value)) {
+        Py_hash_t key_hash = intern_value_hash(key);
+        Py_hash_t value_hash = intern_value_hash(value);
+        if (key_hash == -1 || value_hash == -1) {
+            return NULL;
+        }
+        hash = (((hash * 1000003) ^ key_hash) * 1000003) ^ value_hash;
+    }
+    hash &= PY_SSIZE_T_MAX;
+    *hash_out = hash;
+
+    intern_entry* entry = &st->intern_table[hash % st->intern_size];
+    if (!entry->html || entry->hash != hash || strcmp(entry->tag, tag) != 0 || entry->indent != st->indent ||
+        entry->iterate_children != st->iterate_children || entry->skip_first != skip_first ||
+        PyTuple_GET_SIZE(entry->args) != num_args || (entry->kwargs ? PyDict_GET_SIZE(entry->kwargs) : 0) != num_kwargs) {
+        return entry;
+    }
+    for (Py_ssize_t i = skip_first; i < num_args; i++) {
+        if (!intern_values_equal(PyTuple_GET_ITEM(entry->args, i), PyTuple_GET_ITEM(args, i))) {
+            return entry;
+        }
+    }
+    // Attribute order matters for the output, so the dicts are compared in order
+    PyObject *entry_key, *entry_value;
+    Py_ssize_t entry_pos = 0;
+    pos = 0;
+    while (kwargs && PyDict_Next(kwargs, &pos, &key, &value)) {
+        PyDict_Next(entry->kwargs, &entry_pos, &entry_key, &entry_value);
+        if (!intern_values_equal(entry_key, key) || !intern_values_equal(entry_value, value)) {
+            return entry;
+        }
+    }
+    *hit = 1;
+    return entry;
+}
+
+static void intern_store(fasttag_state* st, intern_entry* entry, Py_hash_t hash, const char* tag, PyObject* args, char skip_first,
+                         PyObject* kwargs, PyObject* html) {
+    intern_clear(entry);
+    entry->hash = hash;
+    strcpy(entry->tag, tag);
+    entry->indent = st->indent;
+    entry->iterate_children = st->iterate_children;
+    entry->skip_first = skip_first;
+    Py_INCREF(args);
+    entry->args = args;
+    Py_XINCREF(kwargs);
+    entry->kwargs = kwargs;
+    Py_INCREF(html);
+    entry->html = html;
+}
+
+static PyObject* fasttag_tag_impl(fasttag_state* st, const char* tag, PyObject* args, char skip_first, PyObject* kwargs,
+                                  Py_ssize_t* size_hint) {
+    FASTTAG_PROBE(tag_entry, tag);
+    int hit = 0;
+    Py_hash_t hash;
+    intern_entry* entry = st->intern_size ? intern_lookup(st, tag, args, skip_first, kwargs, &hash, &hit) : NULL;
+    PyObject* result;
+    if (hit) {
+        result = entry->html;
+        Py_INCREF(result);
+    } else {
+        result = fasttag_tag_render(st, tag, args, skip_first, kwargs, size_hint);
+        if (entry && result) {
+            intern_store(st, entry, hash, tag, args, skip_first, kwargs, result);
+        }
+    }
+    // Size -1 for failed renders
+    FASTTAG_PROBE(tag_return, tag, result ? ((HTMLObject*)result)->size : -1);
+    return result;
+}
+
+static PyObject* fasttag_text(PyObject* self, PyObject* args) {
+    Py_ssize_t num_args = PyTuple_Size(args);
+    if (num_args < 1) {
+        PyErr_SetString(PyExc_TypeError, "Exactly one argument is required (text)");
+        return NULL;
+    }
+    PyObject* arg = PyTuple_GetItem(args, 0);
+    if (!PyUnicode_Check(arg) && !PyBytes_Check(arg)) {
+        PyErr_SetString(PyExc_TypeError, "Argument must be a string or bytes");
+        return NULL;
+    }
+    Py_ssize_t length;
+    const char* data;
+    if (PyUnicode_Check(arg)) {
+        data = PyUnicode_AsUTF8AndSize(arg, &length);
+        if (!data) {
+            return NULL;
+        }
+    } else {
+        length = PyBytes_Size(arg);
+        data = PyBytes_AsString(arg);
+    }
+    Py_ssize_t capacity = size_add(size_mul(length, FT_TEXT_MAX(1, 0)), 1);
+    if (capacity > MAX_HTML_SIZE) {
+        PyErr_SetString(PyExc_OverflowError, "HTML too large");
+        return NULL;
+    }
+    HTMLObject *result_obj = (HTMLObject*)HTML_alloc(((fasttag_state*)PyModule_GetState(self))->HTML_Type, capacity);
+    if (!result_obj) {
+        return PyErr_NoMemory();
+    }
+    char* result = result_obj->data;
+    Py_ssize_t l = ft_write_text(result, data, length, 0);
+    result_obj->size = l;
+    result[l] = '\0';
+    result_obj = HTMLObjectShrink(result_obj, l);
+    if (PyUnicode_Check(arg) && PyUnicode_IS_ASCII(arg)) {
+        result_obj->ascii = ASCII_YES;
+    }
+    return (PyObject *)result_obj;
+}
+
+static PyObject* fasttag_set_indent(PyObject* self, PyObject* args) {
+    // get first argument
+    if (PyTuple_Size(args) != 1) {
+        PyErr_SetString(PyExc_TypeError, "One argument is required");
+        return NULL;
+    }
+    PyObject* arg = PyTuple_GetItem(args, 0);
+    if (!PyLong_Check(arg)) {
+        PyErr_SetString(PyExc_TypeError, "Argument must be an integer");
+        return NULL;
+    }
+    long value = PyLong_AsLong(arg);
+    if (value == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (value < INT_MIN || value > INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "Indentation out of range");
+        return NULL;
+    }
+    ((fasttag_state*)PyModule_GetState(self))->indent = value;
+    Py_RETURN_NONE;
+}
+
+static PyObject* fasttag_set_iterate(PyObject* self, PyObject* arg) {
+    int value = PyObject_IsTrue(arg);
+    if (value < 0) {
+        return NULL;
+    }
+    ((fasttag_state*)PyModule_GetState(self))->iterate_children = value;
+    Py_RETURN_NONE;
+}
+
+static PyObject* fasttag_set_intern(PyObject* self, PyObject* arg) {
+    Py_ssize_t size = PyLong_AsSsize_t(arg);
+    if (size == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (size < 0 || size > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(intern_entry)) {
+        PyErr_SetString(PyExc_ValueError, "Size must be non-negative");
+        return NULL;
+    }
+    intern_entry* table = size ? PyMem_Calloc(size, sizeof(intern_entry)) : NULL;
+    if (size && !table) {
+        return PyErr_NoMemory();
+    }
+    fasttag_state* st = PyModule_GetState(self);
+    intern_entry* old_table = st->intern_table;
+    Py_ssize_t old_size = st->intern_size;
+    st->intern_table = table;
+    st->intern_size = size;
+    for (Py_ssize_t i = 0; i < old_size; i++) {
+        intern_clear(&old_table[i]);
+    }
+    PyMem_Free(old_table);
+    Py_RETURN_NONE;
+}
+
+static PyObject* fasttag_set_spill(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"threshold", "dir", NULL};
+    Py_ssize_t threshold;
+    PyObject* dir = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "n|O", kwlist, &threshold, &dir)) {
+        return NULL;
+    }
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "Threshold must be non-negative");
+        return NULL;
+    }
+#ifndef FASTTAG_HAVE_SPILL
+    if (threshold > 0) {
+        PyErr_SetString(PyExc_NotImplementedError, "Spilling to files is not supported on this platform");
+        return NULL;
+    }
+#endif
+    PyObject* dir_bytes = NULL;
+    if (dir != Py_None && !PyUnicode_FSConverter(dir, &dir_bytes)) {
+        return NULL;
+    }
+    fasttag_state* st = PyModule_GetState(self);
+    Py_XSETREF(st->spill_dir, dir_bytes);
+    st->spill_threshold = threshold;
+    Py_RETURN_NONE;
+}
+
+// Templates: a skeleton rendered with Slot(key) markers in place of values,
+// split into literal segments and slots. render_many fills it for many
+// records into one buffer. Markers are U+E000 (private use, passed through
+// escaping untouched), 'i' or 's' for the key type, the key, and U+E001.
+#define SLOT_OPEN "\xee\x80\x80"
+#define SLOT_CLOSE "\xee\x80\x81"
+
+typedef struct {
+    Py_ssize_t start, length;  // literal segment preceding the slot
+    PyObject* key;             // NULL for the trailing literal
+    char in_attribute;
+    int indent;                // spaces after newlines in text values
+    int raw_indent;            // and in markup
+} template_part;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject* skeleton;
+    Py_ssize_t num_parts;
+    template_part* parts;
+} TemplateObject;
+
+static PyObject* fasttag_slot(PyObject* self, PyObject* key) {
+    if (PyLong_CheckExact(key)) {
+        return PyUnicode_FromFormat("%ci%S%c", 0xE000, key, 0xE001);
+    }
+    if (!PyUnicode_Check(key)) {
+        PyErr_SetString(PyExc_TypeError, "Slot key must be an int or a string");
+        return NULL;
+    }
+    if (PyUnicode_FindChar(key, '<', 0, PY_SSIZE_T_MAX, 1) != -1 || PyUnicode_FindChar(key, '&', 0, PY_SSIZE_T_MAX, 1) != -1 ||
+        PyUnicode_FindChar(key, '"', 0, PY_SSIZE_T_MAX, 1) != -1 || PyUnicode_FindChar(key, '\n', 0, PY_SSIZE_T_MAX, 1) != -1 ||
+        PyUnicode_FindChar(key, 0xE001, 0, PY_SSIZE_T_MAX, 1) != -1) {
+        PyErr_SetString(PyExc_ValueError, "Slot key can't contain <, &, \", or newlines");
+        return NULL;
+    }
+    return PyUnicode_FromFormat("%cs%U%c", 0xE000, key, 0xE001);
+}
+
+// Whether markup at p starts with a tag name
+static int starts_tag_name(const char* p, Py_ssize_t length, const char* name) {
+    Py_ssize_t n = strlen(name);
+    return n < length && memcmp(p, name, n) == 0 && (p[n] == '>' || p[n] == ' ');
+}
+
+// Spaces at the start of the line from line_start, up to end
+static int line_indent(const char* data, Py_ssize_t line_start, Py_ssize_t end) {
+    int spaces = 0;
+    while (line_start + spaces < end && data[line_start + spaces] == ' ') {
+        spaces++;
+    }
+    return spaces;
+}
+
+static PyObject* Template_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    PyObject* skeleton;
+    if (!PyArg_ParseTuple(args, "O!", TYPE_STATE(type)->HTML_Type, &skeleton)) {
+        return NULL;
+    }
+    HTMLObject* html = (HTMLObject*)skeleton;
+    const char* data = html->data;
+    Py_ssize_t size = html->size;
+
+    TemplateObject* self = (TemplateObject*)type->tp_alloc(type, 0);
+    if (!self) {
+        return NULL;
+    }
+    Py_INCREF(skeleton);
+    self->skeleton = skeleton;
+    Py_ssize_t capacity = 8;
+    self->parts = PyMem_Malloc(capacity * sizeof(template_part));
+    if (!self->parts) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    // Markers inside a tag are attribute values, all others are text. Like a
+    // child rendered in their place, values get the indentation of the line
+    // they're on after newlines. Inside pre, text only gets that of the line
+    // the pre starts on, which its ancestors added, and markup one more level.
+    char in_tag = 0, in_quote = 0;
+    Py_ssize_t start = 0, line_start = 0, pre_depth = 0;
+    int pre_indent = 0;
+    int indent = TYPE_STATE(type)->indent;
+    for (Py_ssize_t j = 0; j <= size; j++) {
+        char is_marker = j + 3 <= size && memcmp(data + j, SLOT_OPEN, 3) == 0;
+        if (j < size && !is_marker) {
+            if (data[j] == '\n') {
+                line_start = j + 1;
+            }
+            if (!in_tag && data[j] == '<') {
+                in_tag = 1;
+                if (starts_tag_name(data + j + 1, size - j - 1, "pre") && pre_depth++ == 0) {
+                    pre_indent = line_indent(data, line_start, j);
+                } else if (starts_tag_name(data + j + 1, size - j - 1, "/pre") && pre_depth > 0) {
+                    pre_depth--;
+                }
+            } else if (in_tag && data[j] == '"') {
+                in_quote = !in_quote;
+            } else if (in_tag && !in_quote && data[j] == '>') {
+                in_tag = 0;
+            }
+            continue;
+        }
+        if (self->num_parts == capacity) {
+            capacity *= 2;
+            template_part* parts = PyMem_Realloc(self->parts, capacity * sizeof(template_part));
+            if (!parts) {
+                Py_DECREF(self);
+                return PyErr_NoMemory();
+            }
+            self->parts = parts;
+        }
+        template_part* part = &self->parts[self->num_parts++];
+        part->start = start;
+        part->length = j - start;
+        part->key = NULL;
+        part->in_attribute = in_tag;
+        part->indent = indent <= 0 || in_tag ? 0 : pre_depth ? pre_indent : line_indent(data, line_start, j);
+        part->raw_indent = pre_depth && indent > 0 ? pre_indent + indent : part->indent;
+        if (!is_marker) {
+            break;
+        }
+        const char* key = data + j + 4;
+        const char* key_end = key;
+        while (key_end + 3 <= data + size && memcmp(key_end, SLOT_CLOSE, 3) != 0) {
+            key_end++;
+        }
+        if (key_end + 3 > data + size) {
+            Py_DECREF(self);
+            PyErr_SetString(PyExc_ValueError, "Unterminated slot in template");
+            return NULL;
+        }
+        part->key = PyUnicode_DecodeUTF8(key, key_end - key, NULL);
+        if (part->key && data[j + 3] == 'i') {
+            Py_SETREF(part->key, PyLong_FromUnicodeObject(part->key, 10));
+        }
+        if (!part->key) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        j = key_end + 3 - data;
+        start = j;
+        j--;
+    }
+    return (PyObject*)self;
+}
+
+static void Template_dealloc(PyObject* obj) {
+    TemplateObject* self = (TemplateObject*)obj;
+    for (Py_ssize_t i = 0; i < self->num_parts; i++) {
+        Py_XDECREF(self->parts[i].key);
+    }
+    PyMem_Free(self->parts);
+    Py_XDECREF(self->skeleton);
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free(obj);
+    Py_DECREF(type);
+}
+
+static PyType_Slot Template_slots[] = {
+    {Py_tp_doc, "HTML skeleton with Slot(key) placeholders, filled in by render_many"},
+    {Py_tp_new, Template_new},
+    {Py_tp_dealloc, Template_dealloc},
+    {0, NULL},
+};
+
+static PyType_Spec Template_spec = {
+    .name = "fasttag.Template",
+    .basicsize = sizeof(TemplateObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = Template_slots,
+};
+
+// A slot value extracted from a record while holding the GIL
+typedef struct {
+    char kind;  // one of the VALUE_ constants
+    const char* data;
+    Py_ssize_t length;
+    Py_ssize_t output_length;
+    long long long_value;
+    double double_value;
+} slot_value;
+
+#define VALUE_TEXT 0   // escaped
+#define VALUE_RAW 1    // HTML and bytes in text
+#define VALUE_LONG 2
+#define VALUE_DOUBLE 3
+
+static Py_ssize_t escaped_length(const char* data, Py_ssize_t length, char in_attribute) {
+    return in_attribute ? ft_attr_value_length(data, length) : ft_text_length(data, length);
+}
+
+static char* write_escaped(char* out, const char* data, Py_ssize_t length, char in_attribute) {
+    return out + (in_attribute ? ft_write_attr_value(out, data, length) : ft_write_text(out, data, length, 0));
+}
+
+// Bytes added by writing data with indent spaces after each newline
+static Py_ssize_t indent_length(const char* data, Py_ssize_t length, int indent) {
+    Py_ssize_t newlines = 0;
+    for (const char* p = data; indent > 0 && (p = memchr(p, '\n', data + length - p)); p++) {
+        newlines++;
+    }
+    return size_mul(newlines, indent);
+}
+
+// Fills value from item; str() results are appended to keep alive.
+static int extract_slot_value(PyObject* item, char in_attribute, slot_value* value, PyObject* keep_alive) {
+    if (PyLong_Check(item)) {
+        int overflow;
+        value->long_value = PyLong_AsLongLongAndOverflow(item, &overflow);
+        if (!overflow) {
+            value->kind = VALUE_LONG;
+            return 0;
+        }
+    } else if (PyFloat_Check(item)) {
+        value->kind = VALUE_DOUBLE;
+        value->double_value = PyFloat_AS_DOUBLE(item);
+        return 0;
+    } else if (!in_attribute && HTMLObject_Check(item)) {
+        // Read without the GIL
+        if (HTML_detach((HTMLObject*)item) < 0) {
+            return -1;
+        }
+        value->kind = VALUE_RAW;
+        value->data = ((HTMLObject*)item)->data;
+        value->length = ((HTMLObject*)item)->size;
+        return 0;
+    } else if (!in_attribute && PyBytes_Check(item)) {
+        value->kind = VALUE_RAW;
+        value->data = PyBytes_AS_STRING(item);
+        value->length = PyBytes_GET_SIZE(item);
+        return 0;
+    }
+    PyObject* str = item;
+    if (!PyUnicode_Check(item)) {
+        str = PyObject_Str(item);
+        if (!str) {
+            return -1;
+        }
+        int failed = PyList_Append(keep_alive, str);
+        Py_DECREF(str);
+        if (failed) {
+            return -1;
+        }
+    }
+    value->kind = VALUE_TEXT;
+    value->data = PyUnicode_AsUTF8AndSize(str, &value->length);
+    return value->data ? 0 : -1;
+}
+
+static PyObject* fasttag_render_many(PyObject* self, PyObject* args) {
+    PyObject *template_obj, *records_obj;
+    fasttag_state* st = PyModule_GetState(self);
+    if (!PyArg_ParseTuple(args, "O!O", st->Template_Type, &template_obj, &records_obj)) {
+        return NULL;
+    }
+    TemplateObject* template = (TemplateObject*)template_obj;
+    if (HTML_detach((HTMLObject*)template->skeleton) < 0) {
+        return NULL;
+    }
+    const char* skeleton = ((HTMLObject*)template->skeleton)->data;
+    Py_ssize_t num_slots = template->num_parts - 1;
+    const char* separator = st->indent >= 0 ? "\n" : "";
+    Py_ssize_t separator_length = st->indent >= 0 ? 1 : 0;
+
+    PyObject* records = PySequence_Fast(records_obj, "Records must be a sequence");
+    if (!records) {
+        return NULL;
+    }
+    Py_ssize_t num_records = PySequence_Fast_GET_SIZE(records);
+    PyObject* keep_alive = PyList_New(0);
+    slot_value* values = PyMem_Calloc(num_records * num_slots + 1, sizeof(slot_value));
+    HTMLObject* result_obj = NULL;
+    if (!keep_alive || !values) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    // Pull all values out while holding the GIL. Items are kept alive by the
+    // records (and keep_alive for str() results), which the caller holds.
+    for (Py_ssize_t r = 0; r < num_records; r++) {
+        PyObject* record = PySequence_Fast_GET_ITEM(records, r);
+        for (Py_ssize_t k = 0; k < num_slots; k++) {
+            template_part* part = &template->parts[k];
+            PyObject* item;
+            if (PyDict_Check(record)) {
+                item = PyDict_GetItemWithError(record, part->key);
+                if (!item) {
+                    if (!PyErr_Occurred()) {
+                        PyErr_SetObject(PyExc_KeyError, part->key);
+                    }
+                    goto done;
+                }
+                Py_INCREF(item);
+            } else {
+                item = PyObject_GetItem(record, part->key);
+                if (!item) {
+                    goto done;
+                }
+            }
+            // The record may not hold the item itself (computed by __getitem__)
+            int failed = PyList_Append(keep_alive, item) < 0 ||
+                         extract_slot_value(item, part->in_attribute, &values[r * num_slots + k], keep_alive) < 0;
+            Py_DECREF(item);
+            if (failed) {
+                goto done;
+            }
+        }
+    }
+
+    Py_ssize_t total = num_records > 0 ? size_mul(num_records - 1, separator_length) : 0;
+    Py_BEGIN_ALLOW_THREADS
+    char number[FT_NUMBER_MAX];
+    for (Py_ssize_t r = 0; r < num_records; r++) {
+        for (Py_ssize_t k = 0; k <= num_slots; k++) {
+            template_part* part = &template->parts[k];
+            total = size_add(total, part->length);
+            if (k == num_slots) {
+                break;
+            }
+            slot_value* value = &values[r * num_slots + k];
+            if (value->kind == VALUE_TEXT) {
+                value->output_length = size_add(escaped_length(value->data, value->length, part->in_attribute),
+                                                indent_length(value->data, value->length, part->indent));
+            } else if (value->kind == VALUE_RAW) {
+                value->output_length = size_add(value->length, indent_length(value->data, value->length, part->raw_indent));
+            } else if (value->kind == VALUE_LONG) {
+                value->output_length = ft_write_long(number, value->long_value);
+            } else {
+                value->output_length = ft_write_double(number, value->double_value);
+            }
+            total = size_add(total, value->output_length);
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    if (total > MAX_HTML_SIZE) {
+        PyErr_SetString(PyExc_OverflowError, "HTML too large");
+        goto done;
+    }
+    result_obj = (HTMLObject*)HTML_alloc(st->HTML_Type, total + 1);
+    if (!result_obj) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    char* out = result_obj->data;
+    Py_BEGIN_ALLOW_THREADS
+    for (Py_ssize_t r = 0; r < num_records; r++) {
+        if (r > 0) {
+            memcpy(out, separator, separator_length);
+            out += separator_length;
+        }
+        for (Py_ssize_t k = 0; k <= num_slots; k++) {
+            template_part* part = &template->parts[k];
+            memcpy(out, skeleton + part->start, part->length);
+            out += part->length;
+            if (k == num_slots) {
+                break;
+            }
+            slot_value* value = &values[r * num_slots + k];
+            if (value->kind == VALUE_TEXT && part->indent > 0) {
+                out += ft_write_text(out, value->data, value->length, part->indent);
+            } else if (value->kind == VALUE_TEXT) {
+                out = write_escaped(out, value->data, value->length, part->in_attribute);
+            } else if (value->kind == VALUE_RAW) {
+                out += ft_write_raw(out, value->data, value->length, part->raw_indent);
+            } else if (value->kind == VALUE_LONG) {
+                out += ft_write_long(out, value->long_value);
+            } else {
+                out += ft_write_double(out, value->double_value);
+            }
+        }
+    }
+    *out = '\0';
+    Py_END_ALLOW_THREADS
+    result_obj->size = total;
+
+done:
+    PyMem_Free(values);
+    Py_XDECREF(keep_alive);
+    Py_DECREF(records);
+    return (PyObject*)result_obj;
+}
+
+// Gets the bytes of a join() item; str is escaped like a text child.
+static int join_item(PyObject* item, const char** data, Py_ssize_t* length, char* escape) {
+    *escape = 0;
+    if (HTMLObject_Check(item)) {
+        *data = ((HTMLObject*)item)->data;
+        *length = ((HTMLObject*)item)->size;
+    } else if (PyBytes_Check(item)) {
+        *data = PyBytes_AS_STRING(item);
+        *length = PyBytes_GET_SIZE(item);
+    } else if (PyUnicode_Check(item)) {
+        *data = PyUnicode_AsUTF8AndSize(item, length);
+        *escape = 1;
+        return *data ? 0 : -1;
+    } else {
+        PyErr_Format(PyExc_TypeError, "join() items must be HTML, str or bytes, not %.200s", Py_TYPE(item)->tp_name);
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject* fasttag_join(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"iterable", "sep", NULL};
+    PyObject *iterable, *sep_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist, &iterable, &sep_obj)) {
+        return NULL;
+    }
+    const char* sep = "";
+    Py_ssize_t sep_length = 0;
+    char sep_escape = 0;
+    if (sep_obj && join_item(sep_obj, &sep, &sep_length, &sep_escape) < 0) {
+        return NULL;
+    }
+    Py_ssize_t sep_output_length = sep_escape ? escaped_length(sep, sep_length, 0) : sep_length;
+    PyObject* items = PySequence_Fast(iterable, "join() argument must be iterable");
+    if (!items) {
+        return NULL;
+    }
+
+    // Size the result first, so it's built in one allocation
+    Py_ssize_t num_items = PySequence_Fast_GET_SIZE(items);
+    Py_ssize_t total = num_items > 0 ? size_mul(num_items - 1, sep_output_length) : 0;
+    for (Py_ssize_t i = 0; i < num_items; i++) {
+        const char* data;
+        Py_ssize_t length;
+        char escape;
+        if (join_item(PySequence_Fast_GET_ITEM(items, i), &data, &length, &escape) < 0) {
+            Py_DECREF(items);
+            return NULL;
+        }
+        total = size_add(total, escape ? escaped_length(data, length, 0) : length);
+    }
+    if (total > MAX_HTML_SIZE) {
+        Py_DECREF(items);
+        PyErr_SetString(PyExc_OverflowError, "HTML too large");
+        return NULL;
+    }
+
+    HTMLObject* result_obj = (HTMLObject*)HTML_alloc(((fasttag_state*)PyModule_GetState(self))->HTML_Type, total + 1);
+    if (!result_obj) {
+        Py_DECREF(items);
+        return PyErr_NoMemory();
+    }
+    char* out = result_obj->data;
+    for (Py_ssize_t i = 0; i < num_items; i++) {
+        const char* data = NULL;
+        Py_ssize_t length = 0;
+        char escape = 0;
+        // Can't fail, the UTF-8 of str items is cached by the first pass
+        join_item(PySequence_Fast_GET_ITEM(items, i), &data, &length, &escape);
+        if (i > 0 && sep_escape) {
+            out = write_escaped(out, sep, sep_length, 0);
+        } else if (i > 0) {
+            memcpy(out, sep, sep_length);
+            out += sep_length;
+        }
+        if (escape) {
+            out = write_escaped(out, data, length, 0);
+        } else {
+            memcpy(out, data, length);
+            out += length;
+        }
+    }
+    *out = '\0';
+    result_obj->size = total;
+    Py_DECREF(items);
+    return (PyObject*)result_obj;
+}
+
+// Tables from columnar buffers (NumPy arrays, Arrow buffers, array.array):
+// the buffers are taken with the GIL held, then formatted by the core with
+// it released.
+
+// Format character of a 1-dimensional native buffer, or 0 if it isn't one
+static char buffer_format(Py_buffer* view) {
+    const char* format = view->format ? view->format : "B";
+#if PY_LITTLE_ENDIAN
+    if (*format == '@' || *format == '=' || *format == '<') {
+#else
+    if (*format == '@' || *format == '=' || *format == '>') {
+#endif
+        format++;
+    }
+    return view->ndim == 1 && format[0] && !format[1] ? format[0] : 0;
+}
+
+static int column_from_buffer(PyObject* obj, Py_buffer* view, ft_column* column, Py_ssize_t* num_rows) {
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+        return -1;
+    }
+    char format = buffer_format(view);
+    column->values = view->buf;
+    if (view->itemsize == 8 && (format == 'q' || format == 'l')) {
+        column->kind = FT_COLUMN_INT64;
+    } else if (view->itemsize == 8 && format == 'd') {
+        column->kind = FT_COLUMN_FLOAT64;
+    } else if (view->itemsize == 1 && format == '?') {
+        column->kind = FT_COLUMN_BOOL;
+    } else {
+        PyErr_Format(PyExc_TypeError, "Unsupported column format '%s', expected int64, float64 or bool",
+                     view->format ? view->format : "B");
+        return -1;
+    }
+    *num_rows = view->shape ? view->shape[0] : view->len / view->itemsize;
+    return 0;
+}
+
+// Arrow style string column: (offsets, data) with int32 or int64 offsets
+static int column_from_strings(PyObject* obj, Py_buffer* views, ft_column* column, Py_ssize_t* num_rows) {
+    if (PyTuple_GET_SIZE(obj) != 2) {
+        PyErr_SetString(PyExc_TypeError, "String columns must be (offsets, data) tuples");
+        return -1;
+    }
+    if (PyObject_GetBuffer(PyTuple_GET_ITEM(obj, 0), &views[0], PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+        return -1;
+    }
+    char format = buffer_format(&views[0]);
+    if (!((views[0].itemsize == 4 && (format == 'i' || format == 'l')) ||
+          (views[0].itemsize == 8 && (format == 'q' || format == 'l'))) ||
+        views[0].len < views[0].itemsize) {
+        PyErr_SetString(PyExc_TypeError, "String offsets must be a non-empty int32 or int64 buffer");
+        return -1;
+    }
+    if (PyObject_GetBuffer(PyTuple_GET_ITEM(obj, 1), &views[1], PyBUF_C_CONTIGUOUS) < 0) {
+        return -1;
+    }
+    column->kind = FT_COLUMN_STRING;
+    column->offsets = views[0].buf;
+    column->offset_size = (int)views[0].itemsize;
+    column->values = views[1].buf;
+    column->data_length = views[1].len;
+    *num_rows = views[0].len / views[0].itemsize - 1;
+    return 0;
+}
+
+static PyObject* fasttag_render_table(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"columns", "headers", NULL};
+    PyObject *columns_obj, *headers_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist, &columns_obj, &headers_obj)) {
+        return NULL;
+    }
+    fasttag_state* st = PyModule_GetState(self);
+    PyObject* columns_seq = PySequence_Fast(columns_obj, "Columns must be a sequence");
+    if (!columns_seq) {
+        return NULL;
+    }
+    PyObject* headers_seq = NULL;
+    HTMLObject* result_obj = NULL;
+    Py_ssize_t num_columns = PySequence_Fast_GET_SIZE(columns_seq);
+    // Two buffers per column, offsets and data for strings; unused ones keep a NULL obj
+    Py_buffer* views = PyMem_Calloc(num_columns * 2 + 1, sizeof(Py_buffer));
+    ft_column* columns = PyMem_Calloc(num_columns + 1, sizeof(ft_column));
+    const char** headers = PyMem_Calloc(num_columns + 1, sizeof(char*));
+    size_t* header_lengths = PyMem_Calloc(num_columns + 1, sizeof(size_t));
+    if (!views || !columns || !headers || !header_lengths) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (num_columns == 0) {
+        PyErr_SetString(PyExc_ValueError, "At least one column is required");
+        goto done;
+    }
+
+    Py_ssize_t num_rows = 0;
+    for (Py_ssize_t c = 0; c < num_columns; c++) {
+        PyObject* column = PySequence_Fast_GET_ITEM(columns_seq, c);
+        Py_ssize_t column_rows;
+        int status = PyTuple_Check(column) ? column_from_strings(column, &views[2 * c], &columns[c], &column_rows)
+                                           : column_from_buffer(column, &views[2 * c], &columns[c], &column_rows);
+        if (status < 0) {
+            goto done;
+        }
+        if (c > 0 && column_rows != num_rows) {
+            PyErr_Format(PyExc_ValueError, "Column %zd has %zd rows, expected %zd", c, column_rows, num_rows);
+            goto done;
         }
-        if (!PyUnicode_Check(html)) {
-            return;
+        num_rows = column_rows;
+    }
+    if (headers_obj != Py_None) {
+        headers_seq = PySequence_Fast(headers_obj, "Headers must be a sequence");
+        if (!headers_seq) {
+            goto done;
         }
-        const char* item_str = PyUnicode_AsUTF8(html);
-        int size = strlen(item_str);
-        append_bytes(l, item_str, size, indent, reserved, result_obj, result);
-        Py_DECREF(html);
-    } else if (PyObject_HasAttrString(item, "__ft__")) {
-        PyObject* ft = PyObject_CallMethod(item, "__ft__", NULL);
-        if (!ft) {
-            return;
+        if (PySequence_Fast_GET_SIZE(headers_seq) != num_columns) {
+            PyErr_SetString(PyExc_ValueError, "There must be one header per column");
+            goto done;
         }
-        append_item_to_html(l, ft, indent, disable_indent, i, result_obj, reserved, result);
-        Py_DECREF(ft);
-    
-    } else {
-        item = PyObject_Str(item);
-        if (!item) {
-            return;
+        for (Py_ssize_t c = 0; c < num_columns; c++) {
+            PyObject* header = PySequence_Fast_GET_ITEM(headers_seq, c);
+            if (!PyUnicode_Check(header)) {
+                PyErr_Format(PyExc_TypeError, "Headers must be str, not %.200s", Py_TYPE(header)->tp_name);
+                goto done;
+            }
+            Py_ssize_t length;
+            headers[c] = PyUnicode_AsUTF8AndSize(header, &length);
+            if (!headers[c]) {
+                goto done;
+            }
+            header_lengths[c] = length;
+        }
+    }
+
+    ft_table table = {columns, num_columns, num_rows, headers_seq ? headers : NULL, header_lengths};
+    int indent = st->indent;
+    size_t max;
+    Py_BEGIN_ALLOW_THREADS
+    max = ft_table_max(&table, indent);
+    Py_END_ALLOW_THREADS
+    if (max == (size_t)-1) {
+        PyErr_SetString(PyExc_ValueError, "String offsets out of order or past the end of the data");
+        goto done;
+    }
+    if (max >= (size_t)MAX_HTML_SIZE) {
+        PyErr_SetString(PyExc_OverflowError, "HTML too large");
+        goto done;
+    }
+    result_obj = (HTMLObject*)HTML_alloc(st->HTML_Type, max + 1);
+    if (!result_obj) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    size_t length;
+    Py_BEGIN_ALLOW_THREADS
+    length = ft_write_table(result_obj->data, &table, indent);
+    Py_END_ALLOW_THREADS
+    result_obj->data[length] = '\0';
+    result_obj->size = length;
+    result_obj = HTMLObjectShrink(result_obj, length);
+
+done:
+    if (views) {
+        for (Py_ssize_t i = 0; i < num_columns * 2; i++) {
+            if (views[i].obj) {
+                PyBuffer_Release(&views[i]);
+            }
         }
-        append_item_to_html(l, item, indent, disable_indent, i, result_obj, reserved, result);
-        Py_DECREF(item);
     }
+    PyMem_Free(views);
+    PyMem_Free(columns);
+    PyMem_Free(headers);
+    PyMem_Free(header_lengths);
+    Py_XDECREF(headers_seq);
+    Py_DECREF(columns_seq);
+    return (PyObject*)result_obj;
 }
 
-static PyObject* fasttag_tag_impl(const char* tag, PyObject* args, char skip_first, PyObject* kwargs) {
-    PyObject *key, *value;
-    Py_ssize_t pos = 0;
+// Builder: elements written imperatively into one growing HTML buffer, with
+// the same layout as nested tag calls. An element's children are laid out
+// inline while it has a single one-line text child, like Td("x"); when a
+// second child arrives, the first is moved down onto its own line.
+typedef struct {
+    PyObject* tag;
+    Py_ssize_t children_start;  // offset of the first child
+    Py_ssize_t num_children;
+    char block;  // children on their own lines
+    char pre;    // <pre>: no layout at all
+} builder_element;
 
-    // Process args
-    Py_ssize_t num_args = PyTuple_Size(args);
-    if (skip_first && num_args < 1) {
-        // throw an exception
-        PyErr_SetString(PyExc_TypeError, "At least one argument is required (tag)");
-        return NULL;
+typedef struct {
+    PyObject_HEAD
+    HTMLObject* html;  // NULL until something is written, and after build()
+    Py_ssize_t length;
+    Py_ssize_t reserved;
+    int indent;
+    builder_element* stack;  // open elements
+    Py_ssize_t depth;
+    Py_ssize_t stack_capacity;
+} BuilderObject;
+
+#define BUILDER_INITIAL_SIZE 256
+
+static void Builder_reset(BuilderObject* self) {
+    Py_CLEAR(self->html);
+    self->length = self->reserved = 0;
+    for (Py_ssize_t i = 0; i < self->depth; i++) {
+        Py_DECREF(self->stack[i].tag);
     }
-    int inner_text_multiplier = (indent >= 0) ? (indent + 1) : 1;
+    self->depth = 0;
+}
 
-    // Allocate memory for the new string
+// Makes room for size more bytes and the terminating NUL. Any failure resets
+// the builder, as helpers do with a partial render.
+static char* Builder_reserve(BuilderObject* self, Py_ssize_t size) {
+    if (!self->html) {
+        self->reserved = Py_MAX(size_add(size, 1), BUILDER_INITIAL_SIZE);
+        self->html = (HTMLObject*)HTML_alloc(TYPE_STATE(Py_TYPE(self))->HTML_Type, self->reserved);
+        if (!self->html) {
+            Builder_reset(self);
+            PyErr_NoMemory();
+            return NULL;
+        }
+    }
+    char* data = self->html->data;
+    reserve(TYPE_STATE(Py_TYPE(self)), size_add(self->length, size_add(size, 1)), &self->html, &self->reserved, &data);
+    if (!self->html) {
+        Builder_reset(self);
+        return NULL;
+    }
+    return data;
+}
 
-    // 100 -> 0.17ms, 200 -> 0.17ms
-    // 1000 -> 0.19ms
-    // 100->1000: 0.25ms
-    int reserved = 200;
-    HTMLObject *result_obj = (HTMLObject*)HTML_alloc(&HTML_Type, reserved);
-    char* result = result_obj->data;
+static Py_ssize_t Builder_newline(char* out, int indent, Py_ssize_t level) {
+    if (indent < 0) {
+        return 0;
+    }
+    out[0] = '\n';
+    memset(out + 1, ' ', (size_t)indent * level);
+    return 1 + indent * level;
+}
 
-    if (!result) {
-        return PyErr_NoMemory();
+// Lays out a new child of the innermost element; text is set for text and
+// numbers, inline_text for one-line ones. Returns the indentation for
+// newlines in the child, or -1 on error.
+static int Builder_child(BuilderObject* self, char text, char inline_text, int* space) {
+    *space = 0;
+    if (self->depth == 0) {
+        return 0;
+    }
+    builder_element* parent = &self->stack[self->depth - 1];
+    int indent = self->indent;
+    Py_ssize_t level = self->depth;
+    Py_ssize_t newline = indent >= 0 ? 1 + indent * level : 0;
+    // With indent -1, text from the third child on is separated by a space,
+    // as render_element does, also inside pre
+    *space = indent < 0 && text && parent->num_children > 1;
+    if (parent->pre) {
+        // Text isn't indented inside pre, except by the levels around it
+        parent->num_children++;
+        return indent > 0 ? indent * (int)(level - 1) : 0;
+    }
+    if (parent->num_children == 1 && !parent->block) {
+        // Move the inline child down to its own line
+        char* data = Builder_reserve(self, newline);
+        if (!data) {
+            return -1;
+        }
+        memmove(data + parent->children_start + newline, data + parent->children_start,
+                self->length - parent->children_start);
+        Builder_newline(data + parent->children_start, indent, level);
+        self->length += newline;
+        parent->block = 1;
+    } else if (parent->num_children == 0 && !inline_text) {
+        parent->block = 1;
+    }
+    if (parent->block) {
+        char* data = Builder_reserve(self, newline);
+        if (!data) {
+            return -1;
+        }
+        self->length += Builder_newline(data + self->length, indent, level);
     }
+    parent->num_children++;
+    return indent > 0 ? indent * (int)level : 0;
+}
 
-    // Copy args and kwargs into the new string
-    int l = 0;
-    result[l++] = '<';
-    int extra = 22 + (indent >= 0 ? indent : 0);
-    reserve(strlen(tag) + l, &result_obj, &reserved, &result);
-    if (!result_obj) {
+static PyObject* Builder_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, ":Builder", kwlist)) {
         return NULL;
     }
-    char *tagp = (char*)tag;
-    while (*tagp) {
-        result[l++] = *(tagp++);
+    BuilderObject* self = (BuilderObject*)type->tp_alloc(type, 0);
+    if (!self) {
+        return NULL;
     }
+    self->indent = TYPE_STATE(type)->indent;
+    return (PyObject*)self;
+}
 
-    if (kwargs) {
-        // Copy kwargs
-        pos = 0;
-        while (PyDict_Next(kwargs, &pos, &key, &value)) {
-            // if value is false, continue
-            if (PyBool_Check(value) && value == Py_False) {
-                continue;
-            }
-
-            result[l++] = ' ';
-            const char *key_str = PyUnicode_AsUTF8(key);
-            reserve(strlen(key_str) + l + extra, &result_obj, &reserved, &result);
-            if (!result_obj) {
-                return NULL;
-            }
+static void Builder_dealloc(PyObject* obj) {
+    BuilderObject* self = (BuilderObject*)obj;
+    Builder_reset(self);
+    PyMem_Free(self->stack);
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free(obj);
+    Py_DECREF(type);
+}
 
-            if (key_str[0] == '_') {
-                if (key_str[1] != '\0') {
-                    key_str++;
-                }
-                while (*key_str) {
-                    result[l++] = *(key_str++);
-                }
-            } else {  // transform _ to -
-                while (*key_str) {
-                    if (*key_str == '_') {
-                        result[l++] = '-';
-                    } else {
-                        result[l++] = *key_str;
-                    }
-                    key_str++;
-                }
-            }
-            if (PyBool_Check(value)) {
-                continue;
-            }
-            
-            result[l++] = '=';
-            result[l++] = '"';
-            if (PyLong_Check(value)) {
-                long long_value = PyLong_AsLong(value);
-                char long_str[20];
-                sprintf(long_str, "%ld", long_value);
-                char *long_strp = long_str;
-                while (*long_strp) {
-                    result[l++] = *(long_strp++);
-                }
-            } else if (PyFloat_Check(value)) {
-                double double_value = PyFloat_AsDouble(value);
-                char double_str[20];
-                sprintf(double_str, "%g", double_value);
-                char *double_strp = double_str;
-                while (*double_strp) {
-                    result[l++] = *(double_strp++);
-                }
-            } else {
-                // convert to string if necessary
-                int converted = 0;
-                if (!PyUnicode_Check(value)) {
-                    value = PyObject_Str(value);
-                    if (!value) {
-                        return NULL;
-                    }
-                    converted = 1;
-                }
-                const char *value_str = PyUnicode_AsUTF8(value);
-                reserve(strlen(value_str)*5 + l + extra, &result_obj, &reserved, &result);
-                if (!result_obj) {
-                    return NULL;
-                }
-                while (*value_str) {
-                    // handle " and &
-                    if (*value_str == '&') {
-                        result[l++] = '&';
-                        result[l++] = 'a';
-                        result[l++] = 'm';
-                        result[l++] = 'p';
-                        result[l++] = ';';
-                    } else if (*value_str == '"') {
-                        result[l++] = '&';
-                        result[l++] = 'q';
-                        result[l++] = 'u';
-                        result[l++] = 'o';
-                        result[l++] = 't';
-                        result[l++] = ';';
-                    } else {
-                        result[l++] = *value_str;
-                    }
-                    value_str++;
-                }
-                if (converted) {
-                    Py_DECREF(value);
-                }
-            }
-            result[l++] = '"';
-        }
+static PyObject* Builder_open(BuilderObject* self, PyObject* args, PyObject* kwargs) {
+    PyObject* tag_obj;
+    if (!PyArg_ParseTuple(args, "U:open", &tag_obj)) {
+        return NULL;
     }
-    
-    result[l++] = '>';
-
-    char disable_indent = (skip_first ? 1 : 0) + 1 == num_args;
-
-    if (disable_indent) {
-        // Check that there is no newline
-        PyObject* item = PyTuple_GetItem(args, skip_first ? 1 : 0);
-        if (PyUnicode_Check(item)) {
-            const char *item_str = PyUnicode_AsUTF8(item);
-            for (int j = 0; item_str[j] != '\0'; j++) {
-                if (item_str[j] == '\n') {
-                    disable_indent = 0;
-                    break;
-                }
-            }
-        } else if (PyBytes_Check(item) || HTMLObject_Check(item)) {
-            disable_indent = 0;
+    Py_ssize_t tag_length;
+    const char* tag = PyUnicode_AsUTF8AndSize(tag_obj, &tag_length);
+    if (!tag) {
+        return NULL;
+    }
+    if (self->depth == self->stack_capacity) {
+        Py_ssize_t capacity = self->stack_capacity ? 2 * self->stack_capacity : 16;
+        builder_element* stack = PyMem_Realloc(self->stack, capacity * sizeof(builder_element));
+        if (!stack) {
+            return PyErr_NoMemory();
         }
+        self->stack = stack;
+        self->stack_capacity = capacity;
+    }
+    int space;
+    if (Builder_child(self, 0, 0, &space) < 0) {
+        return NULL;
     }
-    if((skip_first ? 1 : 0) == num_args) {
-        disable_indent = 1;
+    Py_ssize_t extra = 22 + (self->indent >= 0 ? self->indent : 0);
+    char* data = Builder_reserve(self, size_add(tag_length, extra));
+    if (!data) {
+        return NULL;
+    }
+    data[self->length++] = '<';
+    memcpy(data + self->length, tag, tag_length);
+    self->length += tag_length;
+    append_attributes(TYPE_STATE(Py_TYPE(self)), &self->length, kwargs, extra, &self->html, &self->reserved, &data);
+    if (!self->html) {
+        Builder_reset(self);
+        return NULL;
     }
+    data[self->length++] = '>';
+
+    builder_element* element = &self->stack[self->depth++];
+    Py_INCREF(tag_obj);
+    element->tag = tag_obj;
+    element->children_start = self->length;
+    element->num_children = 0;
+    element->block = 0;
+    element->pre = strcmp(tag, "pre") == 0;
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
 
-    if (!strcmp(tag, "pre")) {
-        disable_indent = 1;
+static PyObject* Builder_close(BuilderObject* self, PyObject* Py_UNUSED(ignored)) {
+    if (self->depth == 0) {
+        PyErr_SetString(PyExc_ValueError, "No open element to close");
+        return NULL;
+    }
+    builder_element* element = &self->stack[self->depth - 1];
+    Py_ssize_t tag_length;
+    const char* tag = PyUnicode_AsUTF8AndSize(element->tag, &tag_length);
+    if (!tag) {
+        return NULL;
+    }
+    if (!ft_is_self_closing(tag)) {
+        char* data = Builder_reserve(self, size_add(tag_length, 4 + (self->indent >= 0 ? 1 + self->indent * (self->depth - 1) : 0)));
+        if (!data) {
+            return NULL;
+        }
+        if (element->block) {
+            self->length += Builder_newline(data + self->length, self->indent, self->depth - 1);
+        }
+        data[self->length++] = '<';
+        data[self->length++] = '/';
+        memcpy(data + self->length, tag, tag_length);
+        self->length += tag_length;
+        data[self->length++] = '>';
     }
+    Py_DECREF(element->tag);
+    self->depth--;
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
 
-    for (Py_ssize_t i = (skip_first ? 1 : 0); i < num_args; i++) {
-        if (indent >= 0 && !disable_indent) {
-            result[l++] = '\n';
-            for (int j = 0; j < indent; j++) {
-                result[l++] = ' ';
+static PyObject* Builder_text(BuilderObject* self, PyObject* value) {
+    // Numbers are formatted like children, anything else is converted to str
+    PyObject* converted = NULL;
+    const char* text = NULL;
+    Py_ssize_t size = 0;
+    long long long_value = 0;
+    int overflow = 0;
+    char is_number = PyFloat_Check(value) ||
+        (PyLong_Check(value) && (long_value = PyLong_AsLongLongAndOverflow(value, &overflow), !overflow));
+    if (!is_number) {
+        if (!PyUnicode_Check(value)) {
+            FASTTAG_PROBE(str_fallback, Py_TYPE(value)->tp_name);
+            value = converted = PyObject_Str(value);
+            if (!value) {
+                return NULL;
             }
         }
-        PyObject* item = PyTuple_GetItem(args, i);
-        append_item_to_html(&l, item, indent, disable_indent, i, &result_obj, &reserved, &result);
-        if (!result_obj) {
+        text = PyUnicode_AsUTF8AndSize(value, &size);
+        if (!text) {
+            Py_XDECREF(converted);
             return NULL;
         }
     }
-    if (!is_self_closing_tag(tag)) {
-        if (indent >= 0 && !disable_indent) {
-            result[l++] = '\n';
+    int space;
+    int text_indent = Builder_child(self, 1, is_number || !memchr(text, '\n', size), &space);
+    char* data = text_indent < 0 ? NULL : Builder_reserve(self, size_add(size_mul(size, FT_TEXT_MAX(1, text_indent)), FT_NUMBER_MAX + 1));
+    if (data) {
+        if (space) {
+            data[self->length++] = ' ';
         }
-
-        result[l++] = '<';
-        result[l++] = '/';
-        char *tag2 = (char*)tag;
-        while (*tag2) {
-            result[l++] = *(tag2++);
+        if (!is_number) {
+            self->length += ft_write_text(data + self->length, text, size, text_indent);
+        } else if (PyFloat_Check(value)) {
+            self->length += ft_write_double(data + self->length, PyFloat_AsDouble(value));
+        } else {
+            self->length += ft_write_long(data + self->length, long_value);
         }
-        result[l++] = '>';
     }
-    result_obj->size = l;
-    result[l] = '\0';
-    result_obj = HTMLObjectShrink(result_obj, l);
-
-    return (PyObject *)result_obj;
+    Py_XDECREF(converted);
+    if (!data) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    return (PyObject*)self;
 }
 
-static PyObject* fasttag_text(PyObject* self, PyObject* args) {
-    Py_ssize_t num_args = PyTuple_Size(args);
-    if (num_args < 1) {
-        PyErr_SetString(PyExc_TypeError, "Exactly one argument is required (text)");
-    }
-    PyObject* arg = PyTuple_GetItem(args, 0);
-    if (!PyUnicode_Check(arg) && !PyBytes_Check(arg)) {
-        PyErr_SetString(PyExc_TypeError, "Argument must be a string or bytes");
+static PyObject* Builder_raw(BuilderObject* self, PyObject* value) {
+    const char* markup;
+    Py_ssize_t size;
+    if (HTMLObject_Check(value)) {
+        markup = ((HTMLObject*)value)->data;
+        size = ((HTMLObject*)value)->size;
+    } else if (PyBytes_Check(value)) {
+        markup = PyBytes_AS_STRING(value);
+        size = PyBytes_GET_SIZE(value);
+    } else if (PyUnicode_Check(value)) {
+        markup = PyUnicode_AsUTF8AndSize(value, &size);
+        if (!markup) {
+            return NULL;
+        }
+    } else {
+        PyErr_Format(PyExc_TypeError, "raw() argument must be HTML, bytes or str, not %.200s", Py_TYPE(value)->tp_name);
         return NULL;
     }
-    int length;
-    const char* data;
-    if (PyUnicode_Check(arg)) {
-        data = PyUnicode_AsUTF8(arg);
-        length = strlen(data);
-    } else {
-        length = PyBytes_Size(arg);
-        data = PyBytes_AsString(arg);
+    int space;
+    if (Builder_child(self, 0, 0, &space) < 0) {
+        return NULL;
     }
-    HTMLObject *result_obj = (HTMLObject*)HTML_alloc(&HTML_Type, 4*length);
-    char* result = result_obj->data;
-    int l = 0;
-    for (int j = 0; data[j] != '\0'; j++) {
-        if (data[j] == '<') {
-            result[l++] = '&';
-            result[l++] = 'l';
-            result[l++] = 't';
-            result[l++] = ';';
-        } else if (data[j] == '&') {
-            result[l++] = '&';
-            result[l++] = 'a';
-            result[l++] = 'm';
-            result[l++] = 'p';
-            result[l++] = ';';
-        } else {
-            result[l++] = data[j];
-        }
+    // Markup keeps its own layout, shifted by the levels around it
+    int indent = self->indent > 0 ? self->indent * (int)self->depth : 0;
+    char* data = Builder_reserve(self, size_mul(size, FT_RAW_MAX(1, indent)));
+    if (!data) {
+        return NULL;
     }
-    result_obj->size = l;
-    result[l] = '\0';
-    result_obj = HTMLObjectShrink(result_obj, l);
-    return (PyObject *)result_obj;
+    self->length += ft_write_raw(data + self->length, markup, size, indent);
+    Py_INCREF(self);
+    return (PyObject*)self;
 }
 
-static PyObject* fasttag_set_indent(PyObject* self, PyObject* args) {
-    // get first argument
-    if (PyTuple_Size(args) != 1) {
-        PyErr_SetString(PyExc_TypeError, "One argument is required");
+static PyObject* Builder_build(BuilderObject* self, PyObject* Py_UNUSED(ignored)) {
+    if (self->depth > 0) {
+        PyErr_Format(PyExc_ValueError, "Elements still open: %zd", self->depth);
         return NULL;
     }
-    PyObject* arg = PyTuple_GetItem(args, 0);
-    if (!PyLong_Check(arg)) {
-        PyErr_SetString(PyExc_TypeError, "Argument must be an integer");
+    if (!Builder_reserve(self, 0)) {
         return NULL;
     }
-    indent = PyLong_AsLong(arg);
-    Py_RETURN_NONE;
+    HTMLObject* result = self->html;
+    self->html = NULL;
+    result->size = self->length;
+    result->data[self->length] = '\0';
+    self->length = self->reserved = 0;
+    return (PyObject*)HTMLObjectShrink(result, result->size);
 }
 
+static PyMethodDef Builder_methods[] = {
+    {"open", (PyCFunction)Builder_open, METH_VARARGS | METH_KEYWORDS, "Start an element: open(tag, **attrs)"},
+    {"close", (PyCFunction)Builder_close, METH_NOARGS, "End the innermost open element"},
+    {"text", (PyCFunction)Builder_text, METH_O, "Add escaped text, or a formatted number"},
+    {"raw", (PyCFunction)Builder_raw, METH_O, "Add HTML, bytes or str markup unchanged"},
+    {"build", (PyCFunction)Builder_build, METH_NOARGS, "Return everything written as HTML and start over"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyType_Slot Builder_slots[] = {
+    {Py_tp_doc, "Writes elements one call at a time into a single HTML buffer"},
+    {Py_tp_new, Builder_new},
+    {Py_tp_dealloc, Builder_dealloc},
+    {Py_tp_methods, Builder_methods},
+    {0, NULL},
+};
+
+static PyType_Spec Builder_spec = {
+    .name = "fasttag.Builder",
+    .basicsize = sizeof(BuilderObject),
+    .itemsize = 0,
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE,
+    .slots = Builder_slots,
+};
 
 static PyObject* fasttag_tag(PyObject* self, PyObject* args, PyObject* kwargs) {
     // Process args
@@ -869,162 +3527,83 @@ static PyObject* fasttag_tag(PyObject* self, PyObject* args, PyObject* kwargs) {
     if (num_args < 1) {
         // throw an exception
         PyErr_SetString(PyExc_TypeError, "At least one argument is required (tag)");
+        return NULL;
+    }
+    PyObject* tag_str = PyTuple_GetItem(args, 0);
+    if (!PyUnicode_Check(tag_str)) {
+        PyErr_SetString(PyExc_TypeError, "Tag must be a string");
+        return NULL;
+    }
+    const char* tag = PyUnicode_AsUTF8(tag_str);
+    if (!tag) {
+        return NULL;
+    }
+    fasttag_state* st = PyModule_GetState(self);
+    return fasttag_tag_impl(st, tag, args, 1, kwargs, generic_size_hint(st, tag));
+}
+
+// Takes keyword name out of kwargs as a room size between 0 and 1 MB
+static int pop_room(PyObject* kwargs, const char* name, Py_ssize_t* size) {
+    PyObject* value = kwargs ? PyDict_GetItemString(kwargs, name) : NULL;
+    if (!value) {
+        return 0;
+    }
+    *size = PyLong_AsSsize_t(value);
+    if (*size == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (*size < 0 || *size > (1 << 20)) {
+        PyErr_SetString(PyExc_ValueError, "Headroom and tailroom must be between 0 and 1 MB");
+        return -1;
+    }
+    return PyDict_DelItemString(kwargs, name);
+}
+
+// framed(tag, *children, headroom=0, tailroom=0, **attrs): tag() for the
+// outermost element of a response, with room around it that prepend_raw and
+// append_raw write framing into. Only this render gets the room: the elements
+// inside it are rendered before, without any.
+static PyObject* fasttag_framed(PyObject* self, PyObject* args, PyObject* kwargs) {
+    Py_ssize_t num_args = PyTuple_Size(args);
+    if (num_args < 1 || !PyUnicode_Check(PyTuple_GET_ITEM(args, 0))) {
+        PyErr_SetString(PyExc_TypeError, "Tag must be a string");
+        return NULL;
+    }
+    const char* tag = PyUnicode_AsUTF8(PyTuple_GET_ITEM(args, 0));
+    if (!tag) {
+        return NULL;
     }
-    const char* tag = PyUnicode_AsUTF8(PyTuple_GetItem(args, 0));
-    return fasttag_tag_impl(tag, args, 1, kwargs);
+    // The attributes without headroom and tailroom, in a copy as kwargs can be the caller's dict
+    PyObject* attrs = kwargs ? PyDict_Copy(kwargs) : NULL;
+    if (kwargs && !attrs) {
+        return NULL;
+    }
+    render_room room = {0, 0};
+    PyObject* result = NULL;
+    if (pop_room(attrs, "headroom", &room.headroom) == 0 && pop_room(attrs, "tailroom", &room.tailroom) == 0) {
+        fasttag_state* st = PyModule_GetState(self);
+        FASTTAG_PROBE(tag_entry, tag);
+        result = render_element(st, tag, &PyTuple_GET_ITEM(args, 0), 1, num_args, attrs, NULL, 0,
+                                generic_size_hint(st, tag), &room);
+        FASTTAG_PROBE(tag_return, tag, result ? ((HTMLObject*)result)->size : -1);
+    }
+    Py_XDECREF(attrs);
+    return result;
 }
 
 // static PyObject* fasttag_Div(PyObject* self, PyObject* args, PyObject* kwargs) {
-//         return fasttag_tag_impl("div", args, 0, kwargs);
+//         fasttag_state* st = PyModule_GetState(self);
+//         return fasttag_tag_impl(st, "div", args, 0, kwargs, &st->tag_size_hints[TAG_INDEX_div]);
 // }
 
 #define TAG_IMPL(tag) \
     static PyObject* fasttag_##tag(PyObject* self, PyObject* args, PyObject* kwargs) { \
-        return fasttag_tag_impl(#tag, args, 0, kwargs); \
+        fasttag_state* st = PyModule_GetState(self); \
+        return fasttag_tag_impl(st, #tag, args, 0, kwargs, &st->tag_size_hints[TAG_INDEX_##tag]); \
     }
 
 // List of HTML tags
-TAG_IMPL(a);
-TAG_IMPL(abbr);
-TAG_IMPL(address);
-TAG_IMPL(area);
-TAG_IMPL(article);
-TAG_IMPL(aside);
-TAG_IMPL(audio);
-TAG_IMPL(b);
-TAG_IMPL(base);
-TAG_IMPL(bdi);
-TAG_IMPL(bdo);
-TAG_IMPL(blockquote);
-TAG_IMPL(body);
-TAG_IMPL(br);
-TAG_IMPL(button);
-TAG_IMPL(canvas);
-TAG_IMPL(caption);
-TAG_IMPL(cite);
-TAG_IMPL(code);
-TAG_IMPL(col);
-TAG_IMPL(colgroup);
-TAG_IMPL(data);
-TAG_IMPL(datalist);
-TAG_IMPL(dd);
-TAG_IMPL(del);
-TAG_IMPL(details);
-TAG_IMPL(dfn);
-TAG_IMPL(dialog);
-TAG_IMPL(div);
-TAG_IMPL(dl);
-TAG_IMPL(dt);
-TAG_IMPL(em);
-TAG_IMPL(embed);
-TAG_IMPL(fieldset);
-TAG_IMPL(figcaption);
-TAG_IMPL(figure);
-TAG_IMPL(footer);
-TAG_IMPL(form);
-TAG_IMPL(h1);
-TAG_IMPL(h2);
-TAG_IMPL(h3);
-TAG_IMPL(h4);
-TAG_IMPL(h5);
-TAG_IMPL(h6);
-TAG_IMPL(head);
-TAG_IMPL(header);
-TAG_IMPL(hgroup);
-TAG_IMPL(hr);
-TAG_IMPL(html);
-TAG_IMPL(i);
-TAG_IMPL(iframe);
-TAG_IMPL(img);
-TAG_IMPL(input);
-TAG_IMPL(ins);
-TAG_IMPL(kbd);
-TAG_IMPL(label);
-TAG_IMPL(legend);
-TAG_IMPL(li);
-TAG_IMPL(link);
-TAG_IMPL(main);
-TAG_IMPL(map);
-TAG_IMPL(mark);
-TAG_IMPL(meta);
-TAG_IMPL(meter);
-TAG_IMPL(nav);
-TAG_IMPL(noscript);
-TAG_IMPL(object);
-TAG_IMPL(ol);
-TAG_IMPL(optgroup);
-TAG_IMPL(option);
-TAG_IMPL(output);
-TAG_IMPL(p);
-TAG_IMPL(param);
-TAG_IMPL(picture);
-TAG_IMPL(pre);
-TAG_IMPL(progress);
-TAG_IMPL(q);
-TAG_IMPL(rp);
-TAG_IMPL(rt);
-TAG_IMPL(ruby);
-TAG_IMPL(s);
-TAG_IMPL(samp);
-TAG_IMPL(script);
-TAG_IMPL(section);
-TAG_IMPL(select);
-TAG_IMPL(small);
-TAG_IMPL(source);
-TAG_IMPL(span);
-TAG_IMPL(strong);
-TAG_IMPL(style);
-TAG_IMPL(sub);
-TAG_IMPL(summary);
-TAG_IMPL(sup);
-TAG_IMPL(table);
-TAG_IMPL(tbody);
-TAG_IMPL(td);
-TAG_IMPL(template);
-TAG_IMPL(textarea);
-TAG_IMPL(tfoot);
-TAG_IMPL(th);
-TAG_IMPL(thead);
-TAG_IMPL(time);
-TAG_IMPL(title);
-TAG_IMPL(tr);
-TAG_IMPL(track);
-TAG_IMPL(u);
-TAG_IMPL(ul);
-TAG_IMPL(var);
-TAG_IMPL(video);
-TAG_IMPL(wbr);
-TAG_IMPL(acronym);
-TAG_IMPL(applet);
-TAG_IMPL(basefont);
-TAG_IMPL(bgsound);
-TAG_IMPL(big);
-TAG_IMPL(blink);
-TAG_IMPL(center);
-TAG_IMPL(content);
-TAG_IMPL(dir);
-TAG_IMPL(element);
-TAG_IMPL(font);
-TAG_IMPL(frame);
-TAG_IMPL(frameset);
-TAG_IMPL(image);
-TAG_IMPL(isindex);
-TAG_IMPL(keygen);
-TAG_IMPL(listing);
-TAG_IMPL(marquee);
-TAG_IMPL(menu);
-TAG_IMPL(menuitem);
-TAG_IMPL(multicol);
-TAG_IMPL(nextid);
-TAG_IMPL(nobr);
-TAG_IMPL(noembed);
-TAG_IMPL(noframes);
-TAG_IMPL(plaintext);
-TAG_IMPL(shadow);
-TAG_IMPL(spacer);
-TAG_IMPL(strike);
-TAG_IMPL(tt);
-TAG_IMPL(xmp);
+FASTTAG_TAGS(TAG_IMPL)
 
 #define TAG_METHOD(Tag, tag) {#Tag, (PyCFunction)fasttag_##tag, METH_VARARGS | METH_KEYWORDS, #Tag},
 
@@ -1032,7 +3611,16 @@ TAG_IMPL(xmp);
 static PyMethodDef fasttagMethods[] = {
     {"tag", (PyCFunction)fasttag_tag, METH_VARARGS | METH_KEYWORDS, "Generic tag"},
     {"set_indent", fasttag_set_indent, METH_VARARGS, "Set the indent level"},
+    {"Slot", fasttag_slot, METH_O, "Placeholder for the value of key in a Template"},
+    {"join", (PyCFunction)fasttag_join, METH_VARARGS | METH_KEYWORDS, "Concatenate HTML, bytes and escaped str items into one HTML"},
+    {"render_many", fasttag_render_many, METH_VARARGS, "Render a Template once for each record into one HTML"},
+    {"render_table", (PyCFunction)fasttag_render_table, METH_VARARGS | METH_KEYWORDS, "Render a table from int64, float64, bool and (offsets, data) string column buffers"},
+    {"set_iterate", fasttag_set_iterate, METH_O, "Render iterable children like tuples and skip None and False"},
+    {"set_intern", fasttag_set_intern, METH_O, "Cache up to size small leaf elements and return the same HTML for repeated calls, 0 to disable"},
+    {"set_spill", (PyCFunction)fasttag_set_spill, METH_VARARGS | METH_KEYWORDS, "Spill renders larger than threshold bytes to a temporary file mapping"},
+    {"framed", (PyCFunction)fasttag_framed, METH_VARARGS | METH_KEYWORDS, "Generic tag reserving headroom and tailroom bytes around it for prepend_raw and append_raw"},
     {"Text", fasttag_text, METH_VARARGS, "Text node"},
+    {"arena", fasttag_arena, METH_NOARGS, "Context manager in which renders allocate from one arena, freed at exit; renders growing past the spill threshold leave it and spill as usual"},
 
     // List of HTML tags
     TAG_METHOD(A, a)
@@ -1181,46 +3769,222 @@ static PyMethodDef fasttagMethods[] = {
     {NULL, NULL, 0, NULL} // Sentinel
 };
 
-// Module definition
-static struct PyModuleDef fasttag = {
-    PyModuleDef_HEAD_INIT,
-    "fasttag", // Module name
-    NULL, // Module documentation
-    -1, // Size of per-interpreter state of the module, or -1 if the module keeps state in global variables.
-    fasttagMethods
-};
+static int fasttag_traverse(PyObject* m, visitproc visit, void* arg) {
+    fasttag_state* st = PyModule_GetState(m);
+    Py_VISIT(st->HTML_Type);
+    Py_VISIT(st->HTMLChunk_Type);
+    Py_VISIT(st->Template_Type);
+    Py_VISIT(st->Builder_Type);
+    Py_VISIT(st->Arena_Type);
+    Py_VISIT(st->current_arena);
+#ifdef FASTTAG_HAVE_SHM
+    Py_VISIT(st->FragmentStore_Type);
+#endif
+    for (Py_ssize_t i = 0; i < st->intern_size; i++) {
+        Py_VISIT(st->intern_table[i].args);
+        Py_VISIT(st->intern_table[i].kwargs);
+        Py_VISIT(st->intern_table[i].html);
+    }
+    return 0;
+}
 
-// Module initialization function
-PyMODINIT_FUNC PyInit_fasttag(void) {
-    if (PyType_Ready(&HTML_Type) < 0) {
-        printf("html type ready error\n");
+static int fasttag_clear(PyObject* m) {
+    fasttag_state* st = PyModule_GetState(m);
+    Py_CLEAR(st->HTML_Type);
+    Py_CLEAR(st->HTMLChunk_Type);
+    Py_CLEAR(st->Template_Type);
+    Py_CLEAR(st->Builder_Type);
+    Py_CLEAR(st->Arena_Type);
+    Py_CLEAR(st->current_arena);
+#ifdef FASTTAG_HAVE_SHM
+    Py_CLEAR(st->FragmentStore_Type);
+#endif
+    Py_CLEAR(st->spill_dir);
+    Py_CLEAR(st->str_html);
+    Py_CLEAR(st->str_ft);
+    for (Py_ssize_t i = 0; i < st->intern_size; i++) {
+        intern_clear(&st->intern_table[i]);
+    }
+    return 0;
+}
+
+static void fasttag_free(void* m) {
+    fasttag_clear((PyObject*)m);
+    fasttag_state* st = PyModule_GetState((PyObject*)m);
+    PyMem_Free(st->intern_table);
+    st->intern_table = NULL;
+    st->intern_size = 0;
+    PyMem_Free(st->spare_block);
+    st->spare_block = NULL;
+}
+
+// C API, see capi.h. Each function finds its module state from the table it
+// was called through, so the API of a subinterpreter's module uses that
+// module's types and settings.
+static PyObject* capi_render_tag(fasttag_CAPI* api, const ft_tag* tag, PyObject* const* children,
+                                 Py_ssize_t num_children) {
+    fasttag_state* st = CAPI_STATE(api);
+    FASTTAG_PROBE(tag_entry, tag->name);
+    PyObject* result = render_element(st, tag->name, children, 0, num_children, NULL, tag->attrs, tag->num_attrs,
+                                      generic_size_hint(st, tag->name), NULL);
+    FASTTAG_PROBE(tag_return, tag->name, result ? ((HTMLObject*)result)->size : -1);
+    return result;
+}
+
+static PyObject* capi_html_from_string(fasttag_CAPI* api, const char* data, Py_ssize_t size) {
+    if (size < 0 || size > MAX_HTML_SIZE - 1) {
+        PyErr_SetString(PyExc_OverflowError, "HTML too large");
         return NULL;
     }
+    return HTMLObjectFromStringAndSize(CAPI_STATE(api)->HTML_Type, data, size);
+}
+
+static int capi_append_text(fasttag_CAPI* api, PyObject** html, const char* data, Py_ssize_t size) {
+    HTMLObject* obj = (HTMLObject*)*html;
+    if (!HTMLObject_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "Expected HTML");
+        Py_CLEAR(*html);
+        return -1;
+    }
+    Py_ssize_t capacity = size_add(size_add(obj->size, size_mul(size, FT_TEXT_MAX(1, 0))), 1);
+    if (size < 0 || capacity > MAX_HTML_SIZE) {
+        PyErr_SetString(PyExc_OverflowError, "HTML too large");
+        Py_CLEAR(*html);
+        return -1;
+    }
+    HTMLObject* result;
+    if (Py_REFCNT(obj) == 1 && obj->data == obj->storage && !obj->mapped && !obj->buffer) {
+        // Nobody else can see it change
+        result = HTML_realloc(obj, capacity);
+        if (!result) {
+            Py_CLEAR(*html);
+            PyErr_NoMemory();
+            return -1;
+        }
+        Py_CLEAR(result->str);
+        result->ascii = ASCII_UNKNOWN;
+    } else {
+        result = (HTMLObject*)HTML_alloc(Py_TYPE(obj), capacity);
+        if (!result) {
+            Py_CLEAR(*html);
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(result->data, obj->data, obj->size);
+        result->size = obj->size;
+        Py_DECREF(obj);
+    }
+    Py_ssize_t l = result->size + ft_write_text(result->data + result->size, data, size, 0);
+    result->size = l;
+    result->data[l] = '\0';
+    *html = (PyObject*)HTMLObjectShrink(result, l);
+    return 0;
+}
 
-    PyObject *m = PyModule_Create(&fasttag);
-    if (m == NULL) {
+static const char* capi_html_data(fasttag_CAPI* api, PyObject* obj, Py_ssize_t* size) {
+    if (!HTMLObject_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "Expected HTML");
+        return NULL;
+    }
+    if (HTML_detach((HTMLObject*)obj) < 0) {
         return NULL;
     }
+    *size = ((HTMLObject*)obj)->size;
+    return ((HTMLObject*)obj)->data;
+}
 
-    Py_INCREF(&HTML_Type);
-    if (PyModule_AddObject(m, "HTML", (PyObject*)&HTML_Type) < 0) {
-        printf("html add object error\n");
-        Py_DECREF(&HTML_Type);
-        Py_DECREF(m);
+static PyTypeObject* add_type(PyObject* m, PyType_Spec* spec, int exported) {
+    PyTypeObject* type = (PyTypeObject*)PyType_FromModuleAndSpec(m, spec, NULL);
+    if (!type) {
+        return NULL;
+    }
+    if (exported && PyModule_AddType(m, type) < 0) {
+        Py_DECREF(type);
         return NULL;
     }
+    return type;
+}
+
+// Runs once per interpreter that imports the module, so that every
+// interpreter gets its own types, settings and caches.
+static int fasttag_exec(PyObject* m) {
+    fasttag_state* st = PyModule_GetState(m);
+    st->indent = 2;
+    st->str_html = PyUnicode_InternFromString("__html__");
+    st->str_ft = PyUnicode_InternFromString("__ft__");
+    if (!st->str_html || !st->str_ft) {
+        return -1;
+    }
+    for (int i = 0; i < NUM_TAGS; i++) {
+        st->tag_size_hints[i] = DEFAULT_SIZE_HINT;
+    }
+
+    if (!(st->HTML_Type = add_type(m, &HTML_spec, 1)) ||
+        !(st->HTMLChunk_Type = add_type(m, &HTMLChunk_spec, 0)) ||
+        !(st->Template_Type = add_type(m, &Template_spec, 1)) ||
+        !(st->Builder_Type = add_type(m, &Builder_spec, 1)) ||
+        !(st->Arena_Type = add_type(m, &Arena_spec, 0))) {
+        return -1;
+    }
+    st->current_arena = PyContextVar_New("fasttag.arena", NULL);
+    if (!st->current_arena) {
+        return -1;
+    }
+#ifdef FASTTAG_HAVE_SHM
+    if (!(st->FragmentStore_Type = add_type(m, &FragmentStore_spec, 1))) {
+        return -1;
+    }
+#endif
 
     // Create a HTMLObject constant for doctype:
-    PyObject* doctype = HTMLObjectFromStringAndSize("<!DOCTYPE html>\n", 16);
+    PyObject* doctype = HTMLObjectFromStringAndSize(st->HTML_Type, "<!DOCTYPE html>\n", 16);
     if (doctype == NULL) {
-        Py_DECREF(&HTML_Type);
-        Py_DECREF(m);
-        return NULL;
+        return -1;
     }
     if (PyModule_AddObject(m, "DOCTYPE", doctype) < 0) {
-        Py_DECREF(&HTML_Type);
-        Py_DECREF(m);
-        return NULL;
+        Py_DECREF(doctype);
+        return -1;
     }
-    return m;
+
+    st->capi.version = FASTTAG_CAPI_VERSION;
+    st->capi.render_tag = capi_render_tag;
+    st->capi.html_from_string = capi_html_from_string;
+    st->capi.append_text = capi_append_text;
+    st->capi.html_data = capi_html_data;
+    // The table lives in the module state, so the capsule is only valid while
+    // the module is, like the module's functions
+    PyObject* capsule = PyCapsule_New(&st->capi, FASTTAG_CAPI_NAME, NULL);
+    if (!capsule) {
+        return -1;
+    }
+    if (PyModule_AddObject(m, "_C_API", capsule) < 0) {
+        Py_DECREF(capsule);
+        return -1;
+    }
+    return 0;
+}
+
+static PyModuleDef_Slot fasttag_slots[] = {
+    {Py_mod_exec, fasttag_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+    {0, NULL},
+};
+
+// Module definition
+static struct PyModuleDef fasttag = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "fasttag._fasttag",
+    .m_size = sizeof(fasttag_state),
+    .m_methods = fasttagMethods,
+    .m_slots = fasttag_slots,
+    .m_traverse = fasttag_traverse,
+    .m_clear = fasttag_clear,
+    .m_free = fasttag_free,
+};
+
+// Module initialization function
+PyMODINIT_FUNC PyInit__fasttag(void) {
+    return PyModuleDef_Init(&fasttag);
 }
@@ -0,0 +1,144 @@
+"""Pre-render the constant tag subtrees of component functions.
+
+static_hoist rewrites a function once, at decoration time: every tag call
+whose arguments are all literals (or other such calls) is rendered right
+away and replaced by the resulting HTML constant.
+"""
+import ast
+import builtins
+import inspect
+import textwrap
+import types
+
+from . import _fasttag
+
+
+def _is_renderer(obj):
+    if obj is _fasttag.HTML:
+        return True
+    return (isinstance(obj, types.BuiltinFunctionType)
+            and getattr(obj, "__self__", None) is _fasttag
+            and (obj.__name__ in ("tag", "Text") or obj.__name__[:1].isupper()))
+
+
+def _bound_names(tree):
+    names = set()
+    for node in ast.walk(tree):
+        if isinstance(node, ast.Name) and not isinstance(node.ctx, ast.Load):
+            names.add(node.id)
+        elif isinstance(node, ast.arg):
+            names.add(node.arg)
+        elif isinstance(node, (ast.FunctionDef, ast.AsyncFunctionDef, ast.ClassDef)):
+            names.add(node.name)
+        elif isinstance(node, ast.alias):
+            names.add((node.asname or node.name).split(".")[0])
+        elif isinstance(node, (ast.Global, ast.Nonlocal)):
+            names.update(node.names)
+    return names
+
+
+class _Hoister(ast.NodeTransformer):
+    def __init__(self, namespace, shadowed):
+        self.namespace = namespace
+        self.shadowed = shadowed
+        self.values = {}  # placeholder name -> pre-rendered HTML
+        self.count = 0
+
+    def renderer(self, func):
+        if not isinstance(func, ast.Name) or func.id in self.shadowed:
+            return None
+        obj = self.namespace.get(func.id, getattr(builtins, func.id, None))
+        return obj if _is_renderer(obj) else None
+
+    def is_static(self, node):
+        if isinstance(node, ast.Constant):
+            return not isinstance(node.value, type(...))
+        if isinstance(node, ast.Tuple):
+            return all(self.is_static(elt) for elt in node.elts)
+        return isinstance(node, ast.Name) and node.id in self.values
+
+    def evaluate(self, node):
+        if isinstance(node, ast.Constant):
+            return node.value
+        if isinstance(node, ast.Tuple):
+            return tuple(self.evaluate(elt) for elt in node.elts)
+        return self.values[node.id]
+
+    def visit_Call(self, node):
+        self.generic_visit(node)
+        renderer = self.renderer(node.func)
+        if (renderer is None
+                or not all(self.is_static(arg) for arg in node.args)
+                or not all(kw.arg is not None and self.is_static(kw.value) for kw in node.keywords)):
+            return node
+        try:
+            value = renderer(*[self.evaluate(arg) for arg in node.args],
+                             **{kw.arg: self.evaluate(kw.value) for kw in node.keywords})
+        except Exception:
+            # Leave it to fail (or not) at call time
+            return node
+        # The subtrees spliced into this one are no longer referenced on their own
+        for child in ast.walk(node):
+            if isinstance(child, ast.Name):
+                self.values.pop(child.id, None)
+        name = "__fasttag_static_%d" % self.count
+        self.count += 1
+        self.values[name] = value
+        return ast.copy_location(ast.Name(id=name, ctx=ast.Load()), node)
+
+
+def static_hoist(func):
+    """Decorator pre-rendering the constant tag calls of func into HTML constants.
+
+    The constants are rendered with the indentation set when the decorator
+    runs. It must be the innermost decorator, and functions whose source
+    isn't available are returned unchanged.
+    """
+    code = getattr(func, "__code__", None)
+    if code is None or "__class__" in code.co_freevars:
+        return func
+    try:
+        source = textwrap.dedent(inspect.getsource(func))
+    except (OSError, TypeError):
+        return func
+    function_def = ast.parse(source).body[0]
+    if (not isinstance(function_def, (ast.FunctionDef, ast.AsyncFunctionDef))
+            or function_def.name != code.co_name):
+        return func
+    function_def.decorator_list = []
+
+    hoister = _Hoister(func.__globals__, _bound_names(function_def))
+    function_def = hoister.visit(function_def)
+    if not hoister.values:
+        return func
+
+    # Compile inside a wrapper whose parameters become the free variables of
+    # the new code: the original closure cells plus the hoisted constants.
+    params = list(code.co_freevars) + list(hoister.values)
+    wrapper = ast.FunctionDef(
+        name="__fasttag_hoist",
+        args=ast.arguments(posonlyargs=[], args=[ast.arg(arg=p) for p in params], kwonlyargs=[],
+                           kw_defaults=[], defaults=[]),
+        body=[function_def, ast.Return(ast.Name(id=function_def.name, ctx=ast.Load()))],
+        decorator_list=[])
+    module = ast.fix_missing_locations(ast.Module(body=[wrapper], type_ignores=[]))
+    ast.increment_lineno(module, code.co_firstlineno - 1)
+    compiled = compile(module, code.co_filename, "exec")
+    wrapper_code = next(c for c in compiled.co_consts if isinstance(c, types.CodeType))
+    new_code = next(c for c in wrapper_code.co_consts
+                    if isinstance(c, types.CodeType) and c.co_name == code.co_name)
+    if hasattr(code, "co_qualname"):
+        new_code = new_code.replace(co_qualname=code.co_qualname)
+
+    cells = dict(zip(code.co_freevars, func.__closure__ or ()))
+    for name, value in hoister.values.items():
+        cells[name] = types.CellType(value)
+    hoisted = types.FunctionType(new_code, func.__globals__, func.__name__, func.__defaults__,
+                                 tuple(cells[name] for name in new_code.co_freevars))
+    hoisted.__kwdefaults__ = func.__kwdefaults__
+    hoisted.__qualname__ = func.__qualname__
+    hoisted.__doc__ = func.__doc__
+    hoisted.__module__ = func.__module__
+    hoisted.__annotations__ = func.__annotations__
+    hoisted.__dict__.update(func.__dict__)
+    return hoisted
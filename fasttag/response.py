@@ -0,0 +1,49 @@
+"""Send HTML objects to ASGI and WSGI servers without copying them into bytes.
+
+Both adapters pass memoryview(html) as the body. The view keeps the HTML
+object alive until the server is done with it, and Content-Length is taken
+from its size.
+"""
+
+CONTENT_TYPE = "text/html; charset=utf-8"
+
+
+async def send_html(send, html, status=200, headers=(), content_type=CONTENT_TYPE):
+    """Send html as a complete ASGI HTTP response through the send callable.
+
+    headers is a sequence of (bytes, bytes) pairs added after Content-Type and Content-Length.
+    """
+    body = memoryview(html)
+    await send({
+        "type": "http.response.start",
+        "status": status,
+        "headers": [
+            (b"content-type", content_type.encode("latin-1")),
+            (b"content-length", b"%d" % body.nbytes),
+            *headers,
+        ],
+    })
+    await send({"type": "http.response.body", "body": body})
+
+
+class WSGIResponse:
+    """WSGI application returning html as a single-item iterable.
+
+    Servers that require the body to be exactly bytes (gunicorn asserts it)
+    can't take the memoryview; use html.bytes() with those.
+    """
+
+    def __init__(self, html, status="200 OK", headers=(), content_type=CONTENT_TYPE):
+        self.html = html
+        self.status = status
+        self.headers = list(headers)
+        self.content_type = content_type
+
+    def __call__(self, environ, start_response):
+        body = memoryview(self.html)
+        start_response(self.status, [
+            ("Content-Type", self.content_type),
+            ("Content-Length", str(body.nbytes)),
+            *self.headers,
+        ])
+        return [body]
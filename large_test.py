@@ -1,6 +1,19 @@
 # try to crash the program by using a large input
+import sys
+import fasttag
 from fasttag import *
+
+# Documents over 2 GB need 64-bit sizes. Takes about 4 GB of memory, so it only runs with --huge
+if "--huge" in sys.argv:
+    fasttag.set_indent(-1)
+    chunk = "x" * (1100 << 20)
+    page = Div(chunk, chunk)
+    assert len(memoryview(page)) == 2 * len(chunk) + len("<div></div>")
+    assert bytes(memoryview(page)[-7:]) == b"x</div>"
+    del page
+    fasttag.set_indent(2)
+
 a = Div(" ")
 for i in range(10000):
     # print("len(a):", len(a.bytes()))
-    a = Div(a)
\ No newline at end of file
+    a = Div(a)
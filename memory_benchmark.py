@@ -0,0 +1,190 @@
+# Stress test for memory leaks: renders every child and attribute type many times
+# and reports how much memory each call leaves behind.
+#
+#   python memory_benchmark.py [iterations]
+#
+# Exits with status 1 if any case leaks.
+import gc
+import resource
+import sys
+import tracemalloc
+from array import array
+import fasttag
+from fasttag import *
+
+ITERATIONS = int(sys.argv[1]) if len(sys.argv) > 1 else 1000000
+TRACEMALLOC_ITERATIONS = max(ITERATIONS // 20, 1000)  # tracing slows everything down
+
+
+class HTMLProtocol:
+    def __html__(self):
+        return "<b>custom</b>"
+
+
+class BytesHTMLProtocol:
+    def __html__(self):
+        return b"<b>bytes</b>"
+
+
+class FTProtocol:
+    def __ft__(self):
+        return Span("ft")
+
+
+class NonStrHTML:
+    def __html__(self):
+        return 42
+
+
+class RaisingHTML:
+    def __html__(self):
+        raise ValueError("raising __html__")
+
+
+class Fallback:
+    def __str__(self):
+        return "fallback & <str>"
+
+
+class RaisingStr:
+    def __str__(self):
+        raise ValueError("raising __str__")
+
+
+html = Span("html")
+static = b"<nav>static</nav>"
+page = Div(H1("Title &amp; more"), Script("x < y"), P("text", B("bold")))
+row = Template(Tr(Td(Slot("name")), Td(Slot("value"), title=Slot("name")), Td(Slot("html"))))
+records = [{"name": "a & b", "value": 1.5, "html": html}, {"name": Fallback(), "value": 10 ** 30, "html": b"<i/>"}]
+table_columns = [array("q", range(10)), array("d", range(10)), (array("i", range(11)), b"a&b<c>defg")]
+cases = {
+    "str": lambda: Div("Hello & <world>"),
+    "str with newlines": lambda: Div("Hello\nworld", "again"),
+    "bytes": lambda: Div(b"<i>bytes</i>"),
+    "HTML": lambda: Div(html),
+    "int": lambda: Div(12345),
+    "large int": lambda: Div(10 ** 30),
+    "float": lambda: Div(3.25),
+    "tuple": lambda: Div(("a", ("b", 1), html)),
+    "__html__": lambda: Div(HTMLProtocol()),
+    "__html__ bytes": lambda: Div(BytesHTMLProtocol()),
+    "__ft__": lambda: Div(FTProtocol()),
+    "fallback": lambda: Div(Fallback()),
+    "many children": lambda: Div(*["child &"] * 50),
+    "tag()": lambda: tag("my-element", "text", data_x=1),
+    "Text": lambda: Text("a & b < c"),
+    "attr str": lambda: Div(title='Tom & "Jerry"'),
+    "attr int": lambda: Div(width=100, height=10 ** 30),
+    "attr float": lambda: Div(value=1.5),
+    "attr bool": lambda: Input(checked=True, disabled=False),
+    "attr fallback": lambda: Div(data=[1, 2, 3]),
+    "attrs getter": lambda: html.attrs,
+    "tag getter": lambda: html.tag,
+    "str()": lambda: str(html),
+    "HTML.view": lambda: Div(HTML.view(static)),
+    "str() new": lambda: str(Div("Hello & <world>")),
+    "str() non-ASCII": lambda: str(Div("caf\u00e9")),
+    "str() invalid UTF-8 (error)": lambda: str(HTML(b"\xff")),
+    "text()": lambda: page.text(),
+    "add": lambda: html + html,
+    "interned": lambda: interned(lambda: Td("0", _class="cell", width=1, on=True)),
+    "+=": lambda: concatenate(html),
+    "join": lambda: fasttag.join([html, "a & b", b"<i/>"], sep=" "),
+    "join bad item (error)": lambda: fasttag.join([html, 1]),
+    "render_many": lambda: render_many(row, records),
+    "render_many missing key (error)": lambda: render_many(row, [{}]),
+    "arena": lambda: in_arena(lambda: Div(Tr(Td(1), Td("a & b")), Tr(Td(2.5), Td(html)), P(*["x"] * 50))),
+    "arena memoryview": lambda: in_arena(lambda: memoryview(Div(html))),
+    "prepend_raw": lambda: fasttag.framed("div", html, headroom=64, tailroom=16).prepend_raw(b"HTTP/1.1 200 OK\r\n\r\n").append_raw(b"\r\n"),
+    "prepend_raw copy": lambda: html.prepend_raw(b"HTTP/1.1 200 OK\r\n\r\n"),
+    "Builder": lambda: build(["a & b", 1, 1.5]),
+    "Builder attr __str__ raising (error)": lambda: Builder().open("div", a=RaisingStr()),
+    "render_table": lambda: render_table(table_columns, headers=["id", "value", "name"]),
+    "render_table bad offsets (error)": lambda: render_table([(array("i", [0, 9]), b"a")]),
+    "__html__ non-str (error)": lambda: Div(NonStrHTML()),
+    "__html__ raising (error)": lambda: Div(RaisingHTML()),
+    "__str__ raising (error)": lambda: Div(RaisingStr()),
+    "attr __str__ raising (error)": lambda: Div(a=RaisingStr()),
+}
+
+
+def concatenate(part):
+    page = part
+    for _ in range(20):
+        page += part
+    return page
+
+
+def build(items):
+    builder = Builder()
+    builder.open("ul", _class="list")
+    for item in items:
+        builder.open("li").text(item).raw(html).close()
+    return builder.close().build()
+
+
+def in_arena(f):
+    with fasttag.arena():
+        return f()
+
+
+def interned(f):
+    fasttag.set_intern(16)
+    try:
+        for _ in range(3):
+            f()
+    finally:
+        fasttag.set_intern(0)
+
+
+def call(f):
+    try:
+        f()
+    except (TypeError, ValueError, KeyError):
+        pass
+
+
+def rss():
+    try:
+        with open("/proc/self/statm") as statm:
+            return int(statm.read().split()[1]) * resource.getpagesize()
+    except OSError:
+        # Peak RSS, in KB on Linux and bytes on macOS
+        usage = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+        return usage if sys.platform == "darwin" else usage * 1024
+
+
+def measure(f):
+    for _ in range(1000):
+        call(f)
+    gc.collect()
+    blocks, memory = sys.getallocatedblocks(), rss()
+    for _ in range(ITERATIONS):
+        call(f)
+    gc.collect()
+    blocks, memory = sys.getallocatedblocks() - blocks, rss() - memory
+
+    tracemalloc.start()
+    for _ in range(100):
+        call(f)
+    traced = tracemalloc.get_traced_memory()[0]
+    for _ in range(TRACEMALLOC_ITERATIONS):
+        call(f)
+    gc.collect()
+    traced = tracemalloc.get_traced_memory()[0] - traced
+    tracemalloc.stop()
+    return blocks / ITERATIONS, memory / ITERATIONS, traced / TRACEMALLOC_ITERATIONS
+
+
+fasttag.set_indent(2)
+print("%28s %14s %14s %14s" % ("", "blocks/call", "RSS B/call", "traced B/call"))
+leaking = []
+for name, f in cases.items():
+    blocks, memory, traced = measure(f)
+    print("%28s %14.4f %14.4f %14.4f" % (name, blocks, memory, traced))
+    if blocks > 0.01 or traced > 1:
+        leaking.append(name)
+
+if leaking:
+    print("Leaking:", ", ".join(leaking))
+    sys.exit(1)
@@ -1,11 +1,18 @@
+import sys
 from setuptools import setup, Extension
 
-module = Extension('fasttag', sources=['fasttag/fasttag.c'])
+# shm_open lives in librt before glibc 2.34
+module = Extension('fasttag._fasttag', sources=['fasttag/fasttag.c', 'fasttag/core.c'],
+                   depends=['fasttag/core.h', 'fasttag/capi.h'],
+                   libraries=['rt'] if sys.platform.startswith('linux') else [])
 
 setup(
     name='fasttag',
     version='0.1.6',
     description='Extremely fast HTML tag generator',
+    packages=['fasttag'],
+    # Headers for extensions using the C API, see fasttag.get_include()
+    package_data={'fasttag': ['core.h', 'capi.h']},
     ext_modules=[module],
     long_description=open('README.md').read(),
     long_description_content_type='text/markdown',
@@ -17,7 +24,7 @@ setup(
         'License :: OSI Approved :: MIT License',
         'Operating System :: OS Independent',
     ],
-    python_requires='>=3.6',
+    python_requires='>=3.9',
 )
 
 # Release:
@@ -1,4 +1,4 @@
-import sys, pickle
+import sys, os, pickle, asyncio
 sys.path.append("build/lib.macosx-14.5-arm64-cpython-312")
 import fasttag
 from fasttag import *
@@ -11,6 +11,7 @@ assert_equal(tag("span", "wow", a='Tom & Jerry "the mouse"'), HTML('<span a="Tom
 assert_equal(tag("c", "cc", _class="a b c"), HTML('<c class="a b c">cc</c>'))
 assert_equal(tag("b", "bb", hx_target="closest tr"), HTML('<b hx-target="closest tr">bb</b>'))
 assert_equal(tag("input", type="text", value="value"), HTML('<input type="text" value="value">'))
+assert_equal(tag("my-very-long-custom-element-name"), HTML('<my-very-long-custom-element-name></my-very-long-custom-element-name>'))
 assert_equal(Div("value"), HTML('<div>value</div>'))
 assert_equal(Input(type="checkbox", checked=True, disabled=False), HTML('<input type="checkbox" checked>'))
 fasttag.set_indent(2)
@@ -34,6 +35,12 @@ assert_equal(Div(("hello", ("world", "nested"))), HTML('<div>\nhello\n\nworld\nn
 assert_equal(Div(({"a": 2})), HTML("<div>{'a': 2}</div>"))
 assert_equal(Div(["a", 2]), HTML("<div>['a', 2]</div>"))
 assert_equal(Div(a=[1,2]), HTML('<div a="[1, 2]"></div>'))
+fasttag.set_iterate(True)
+assert_equal(Div(["hello", ("world", "nested")]), Div(("hello", ("world", "nested"))))
+assert_equal(Div(x for x in ["a", None, 2]), Div(("a", 2)))
+assert_equal(Div(None, "value", False), HTML('<div>value</div>'))
+assert_equal(Div({"a": 2}), HTML("<div>{'a': 2}</div>"))
+fasttag.set_iterate(False)
 assert_equal(Div(a=["'",'"']), HTML('''<div a="[&quot;'&quot;, '&quot;']"></div>'''))
 assert_equal(Div(fasthtml.common.Span("hello")), HTML("<div><span>hello</span>\n  </div>"))
 assert_equal(Div("value", a="b", ccc="d", and2="tom&jerry").attrs,
@@ -44,9 +51,462 @@ class HTML_Test:
         return "hello"
 
 assert_equal(Div(HTML_Test()), HTML("<div>hello</div>"))
+assert_equal(Div(HTML_Test()), HTML("<div>hello</div>"))  # cached lookup
+HTML_Test.__html__ = lambda self: b"<i>bytes</i>"
+assert_equal(Div(HTML_Test()), HTML("<div><i>bytes</i></div>"))
+HTML_Test.__html__ = lambda self: Span("html")
+assert_equal(Div(HTML_Test()), HTML("<div><span>html</span></div>"))
+del HTML_Test.__html__
+assert str(Div(HTML_Test())).startswith("<div>&lt;__main__.HTML_Test object")
+# __html__ assigned on an instance counts too, even once the type is cached as having none
+instance = HTML_Test()
+instance.__html__ = lambda: "<b>instance</b>"
+assert_equal(Div(instance), HTML("<div><b>instance</b></div>"))
+del instance.__html__
+instance.__ft__ = lambda: Span("ft")
+assert_equal(Div(instance), HTML("<div><span>ft</span></div>"))
+assert str(Div(HTML_Test())).startswith("<div>&lt;__main__.HTML_Test object")
+
+class Dynamic:
+    def __getattr__(self, name):
+        if name == "__ft__" and self.ft:
+            return lambda: Span("ft")
+        raise AttributeError(name)
+    def __str__(self):
+        return "str"
+
+dynamic = Dynamic()
+dynamic.ft = True
+assert_equal(Div(dynamic), HTML("<div><span>ft</span></div>"))
+dynamic.ft = False
+assert_equal(Div(dynamic), HTML("<div>str</div>"))
+
+page = Html(Head(Title("A & B"), Script("if (a < b) {}")),
+            Body(H1("Hello"), P("x ", B("bo"), A("ld", href="/?a>b")), Ul(Li("1 < 2"), Li("caf\u00e9"))))
+assert_equal(page.text(), "A & B Hello x bo ld 1 < 2 caf\u00e9")
+assert_equal(HTML("<!-- c -->a&nbsp;b&#x263A;<style>p { }</style>").text(), "a b\u263a")
+assert_equal(HTML("").text(), "")
 
 a = HTML("<p>hello</p>")
 assert_equal(pickle.loads(pickle.dumps(a)), a)
+assert_equal(pickle.loads(pickle.dumps(a, protocol=5)), a)
+buffers = []
+data = pickle.dumps(a, protocol=5, buffer_callback=buffers.append)
+assert_equal(len(buffers), 1)
+assert_equal(pickle.loads(data, buffers=buffers), a)
+assert_equal(HTML(memoryview(b'<p a="1">hello</p>!')[:18]).attrs, {"a": "1"})
+assert_equal(HTML(bytearray(b"<p>hello</p>")), a)
+
+# HTML.view shares read-only buffers and rejects writable ones, whose changes would
+# leave its cached str stale; HTML() copies them
+import mmap, tempfile
+source = bytearray(b"<p>hello</p>")
+try:
+    HTML.view(source)
+    assert False, "expected BufferError"
+except BufferError:
+    pass
+copied = HTML(source)
+assert_equal(str(copied), "<p>hello</p>")
+source[3] = ord("j")
+assert_equal(str(copied), "<p>hello</p>")
+assert_equal(bytes(copied), b"<p>hello</p>")
+with tempfile.TemporaryFile() as f:
+    f.write(b"<nav>static</nav>")
+    f.flush()
+    try:
+        HTML.view(mmap.mmap(f.fileno(), 0))
+        assert False, "expected BufferError"
+    except BufferError:
+        pass
+    mapping = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    nav = HTML.view(mapping)
+    assert_equal(Div(nav), Div(HTML("<nav>static</nav>")))
+    assert_equal(str(nav + Br()), "<nav>static</nav><br>")
+    assert_equal(pickle.loads(pickle.dumps(nav)), nav)
+    try:
+        mapping.close()
+        assert False, "expected BufferError"
+    except BufferError:
+        pass
+    del nav
+    mapping.close()
+
+# A huge render doesn't make the following small ones allocate huge buffers
+import tracemalloc
+big = Div("x" * (1 << 24))
+del big
+tracemalloc.start()
+for _ in range(3):
+    Div("small")
+assert tracemalloc.get_traced_memory()[1] < 64 * 1024, tracemalloc.get_traced_memory()
+tracemalloc.stop()
+
+rows = [Tr(Td(str(i)), Td("a & b")) for i in range(100)]
+unspilled = Table(*rows)
+spill_dir = tempfile.mkdtemp()
+def spill_mappings():
+    with open("/proc/self/maps") as maps:
+        return [line for line in maps if spill_dir + "/fasttag-" in line]
+fasttag.set_spill(1000, dir=spill_dir)
+spilled = Table(*rows)
+assert_equal(spilled, unspilled)
+assert_equal(Div(Table(*rows)), Div(unspilled))
+# The render is backed by a mapping of a file in spill_dir, unlinked right away, and unmapped with it
+if os.path.exists("/proc/self/maps"):
+    assert_equal(len(spill_mappings()), 1)
+    del spilled
+    assert_equal(spill_mappings(), [])
+assert_equal(os.listdir(spill_dir), [])
+os.rmdir(spill_dir)
+fasttag.set_spill(0)
+
+def contact_form(email):
+    return Form(Div(Label("Email"), Input(type="email", required=True)), Div(Label("Name"), email))
+hoisted_form = static_hoist(contact_form)
+assert_equal(hoisted_form("joe@blow.com"), contact_form("joe@blow.com"))
+assert_equal(len(hoisted_form.__closure__), 2)
+
+store = fasttag.FragmentStore("/fasttag_test_%d" % os.getpid(), size=1 << 20, block_size=1024)
+store.unlink()
+nav = Nav(Ul(Li("Home"), Li("About")))
+assert_equal(store.get("nav"), None)
+assert_equal(store.put("nav", nav), True)
+assert_equal(store.get("nav"), nav)
+assert_equal(store.put("big", Div("x" * 2000)), False)
+
+# Workers killed while holding what get returned don't keep slots from being reused
+import multiprocessing, signal
+def hold_fragment(ready):
+    held = store.get("nav")
+    ready.set()
+    signal.pause()
+fork = multiprocessing.get_context("fork")
+for version in range(12):
+    ready = fork.Event()
+    worker = fork.Process(target=hold_fragment, args=(ready,))
+    worker.start()
+    ready.wait()
+    worker.kill()
+    worker.join()
+    assert_equal(store.put("nav", Nav("v%d" % version)), True)
+assert_equal(store.get("nav"), Nav("v11"))
+
+from fasttag.response import send_html, WSGIResponse
+page = Div("hello")
+assert_equal(memoryview(page).tobytes(), b"<div>hello</div>")
+messages = []
+async def collect(message): messages.append(message)
+asyncio.run(send_html(collect, page))
+assert_equal(messages[0]["headers"][1], (b"content-length", b"16"))
+assert_equal(bytes(messages[1]["body"]), b"<div>hello</div>")
+started = []
+body = WSGIResponse(page)({}, lambda status, headers: started.append((status, headers)))
+assert_equal(started[0][1][1], ("Content-Length", "16"))
+assert_equal(b"".join(body), b"<div>hello</div>")
+
+try:
+    fasttag.set_indent(2 ** 40)
+    assert False, "expected OverflowError"
+except OverflowError:
+    pass
+
+fasttag.set_intern(1024)
+assert Td("0") is Td("0")
+assert Span("N/A", _class="badge") is Span("N/A", _class="badge")
+assert Td(1) is not Td(True)
+assert_equal(str(Td(1.0)), "<td>1</td>")
+assert_equal(str(Input(checked=1)), '<input checked="1">')
+assert_equal(str(Input(checked=True)), "<input checked>")
+assert Span("a", _class="x") is not Span("a", _class="y")
+# 0.0 == -0.0 but they render differently, so floats are compared bitwise
+assert_equal(str(Td(0.0)), "<td>0</td>")
+assert_equal(str(Td(-0.0)), "<td>-0</td>")
+assert_equal(str(Input(value=0.0)), '<input value="0">')
+assert_equal(str(Input(value=-0.0)), '<input value="-0">')
+nan = float("nan")
+assert Td(nan) is Td(nan)
+assert Div(Span("a")) is not Div(Span("a"))
+fasttag.set_indent(-1)
+assert_equal(str(Div("a", "b")), "<div>ab</div>")
+fasttag.set_indent(2)
+assert_equal(str(Div("a", "b")), "<div>\n  a\n  b\n</div>")
+fasttag.set_intern(0)
+assert Td("0") is not Td("0")
+
+# Each interpreter gets its own module state: settings changed in a
+# subinterpreter don't leak into this one
+try:
+    import _interpreters as interpreters
+except ImportError:
+    try:
+        import _xxsubinterpreters as interpreters
+    except ImportError:
+        interpreters = None
+if interpreters:
+    interp = interpreters.create()
+    try:
+        interpreters.run_string(interp, "\n".join([
+            "import sys",
+            "sys.path[:] = %r" % sys.path,
+            "import fasttag",
+            "fasttag.set_indent(-1)",
+            "assert str(fasttag.Div('a', 'b')) == '<div>ab</div>'",
+            "assert str(fasttag.DOCTYPE + fasttag.Html()) == '<!DOCTYPE html>\\n<html></html>'",
+        ]))
+    finally:
+        interpreters.destroy(interp)
+    assert_equal(str(Div("a", "b")), "<div>\n  a\n  b\n</div>")
+
+# str() is cached, and a plain copy for renders known to be ASCII
+page = Div(Span("a & b"), 1, 2.5, ("x", True), title="t", width=3)
+assert str(page) is str(page)
+assert page.__html__() is str(page)
+source = "<p>caf\u00e9</p>"
+assert str(HTML(source)) is source
+for html, expected in [(Div(Span("caf\u00e9")), "<div>\n  <span>caf\u00e9</span>\n</div>"),
+                       (Div("a", title="\u00e9"), '<div title="\u00e9">a</div>'),
+                       (tag("x-\u00e9"), "<x-\u00e9></x-\u00e9>"),
+                       (Div(b"\xc3\xa9"), "<div>\n  \u00e9\n</div>"),
+                       (Span("a") + HTML("\u00e9"), "<span>a</span>\u00e9"),
+                       (Text("\u263a <"), "\u263a &lt;")]:
+    assert_equal(str(html), expected)
+for _ in range(2):
+    try:
+        str(HTML(b"\xff"))
+        assert False, "expected UnicodeDecodeError"
+    except UnicodeDecodeError:
+        pass
+
+# Renders inside an arena come out the same, and objects that outlive it keep their data
+def arena_page():
+    return Div(*[Tr(Td(i), Td("name & %d" % i), Td(i * 1.5, _class="x")) for i in range(300)], Pre("a\nb"))
+expected = str(arena_page())
+with fasttag.arena() as arena:
+    page = arena_page()
+    cell = Td("kept")
+    view = memoryview(Span("view"))
+    skeleton = Template(Li(Slot(0)))
+    assert_equal(page.text()[:9], "0 name & ")
+    with fasttag.arena():
+        inner = P("inner")
+    total = page
+    total += inner
+assert_equal(str(page), expected)
+assert_equal(str(total), expected + "<p>inner</p>")
+assert_equal(str(cell), "<td>kept</td>")
+assert_equal(bytes(view), b"<span>view</span>")
+assert_equal(str(render_many(skeleton, [("a",)])), "<li>a</li>")
+assert_equal(pickle.loads(pickle.dumps(page, protocol=5)), page)
+for misuse in (arena.__exit__, lambda *args: [arena.__enter__(), arena.__enter__()]):
+    try:
+        misuse(None, None, None)
+        assert False, "expected RuntimeError"
+    except RuntimeError:
+        pass
+arena.__exit__(None, None, None)
+# Renders in an arena still spill past the threshold instead of growing the arena
+fasttag.set_spill(1 << 16)
+with fasttag.arena():
+    large = Div(*[Td(i) for i in range(20000)])
+    if os.path.exists("/proc/self/maps"):
+        with open("/proc/self/maps") as maps:
+            assert any("/fasttag-" in line for line in maps)
+    assert_equal(str(Td(1)), "<td>1</td>")
+fasttag.set_spill(0)
+assert_equal(large, Div(*[Td(i) for i in range(20000)]))
+del large
+
+# HTTP framing is written around a framed render without copying it
+body = fasttag.framed("div", P("hello"), Span("x"), headroom=64, tailroom=16)
+assert_equal(body, Div(P("hello"), Span("x")))
+head = b"HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n" % len(bytes(body))
+response = body.prepend_raw(head)
+assert_equal(bytes(response), head + bytes(body))
+assert_equal(bytes(body), b"<div>\n  <p>hello</p>\n  <span>x</span>\n</div>")
+chunked = body.prepend_raw(b"2f\r\n").append_raw(b"\r\n").prepend_raw(b"X: 1\r\n\r\n")
+assert_equal(bytes(chunked), b"X: 1\r\n\r\n2f\r\n" + bytes(body) + b"\r\n")
+# Room that's already used, or too small, falls back to a copy
+assert_equal(bytes(body.prepend_raw(b"again ")), b"again " + bytes(body))
+assert_equal(bytes(response.prepend_raw(b"x" * 100)), b"x" * 100 + bytes(response))
+assert_equal(bytes(chunked.append_raw(b"0\r\n\r\n")), bytes(chunked) + b"0\r\n\r\n")
+assert_equal(bytes(response), head + bytes(body))
+assert_equal(HTML("a").prepend_raw(b"<").append_raw(memoryview(b">")), HTML("<a>"))
+assert_equal(fasttag.framed("a", "x", href="/", headroom=8), A("x", href="/"))
+try:
+    fasttag.framed("div", headroom=-1)
+    assert False
+except ValueError:
+    pass
+# Only the framed render reserves room, not the elements inside it
+tracemalloc.start()
+cells = [Td(i) for i in range(1000)]
+row = fasttag.framed("tr", *cells, headroom=1 << 16, tailroom=1 << 12)
+assert tracemalloc.get_traced_memory()[1] < 1 << 20, tracemalloc.get_traced_memory()
+tracemalloc.stop()
+assert_equal(bytes(row.prepend_raw(b"x" * 1000))[:1001], b"x" * 1000 + b"<")
+
+# += shares a buffer between results, without changing earlier ones
+page = Span("a")
+first = page
+page += Span("b")
+second = page
+page += Span("c")
+second += Span("d")
+assert_equal(str(first), "<span>a</span>")
+assert_equal(str(page), "<span>a</span><span>b</span><span>c</span>")
+assert_equal(str(second), "<span>a</span><span>b</span><span>d</span>")
+for _ in range(100):
+    page += Span("e")
+assert_equal(str(page), "<span>a</span><span>b</span><span>c</span>" + "<span>e</span>" * 100)
+assert_equal(str(fasttag.join([Span("a"), "<&", b"<i>raw</i>"], sep=" & ")),
+             "<span>a</span> &amp; &lt;&amp; &amp; <i>raw</i>")
+assert_equal(str(fasttag.join(x for x in [Br(), Br()])), "<br><br>")
+assert_equal(str(fasttag.join([])), "")
+
+row = Template(Tr(Td(Slot("name")), Td(Slot(0), title=Slot("title")), Td(Slot("extra"))))
+records = [
+    {"name": "a < b & c", 0: 1, "title": 'say "hi"', "extra": "x"},
+    {"name": "plain", 0: 2.5, "title": 10 ** 30, "extra": None},
+]
+expected = [Tr(Td(r["name"]), Td(r[0], title=r["title"]), Td(r["extra"])) for r in records]
+# The skeleton's layout is kept: slots are filled in place, as single-line text children
+
+assert_equal(str(render_many(row, records)), "\n".join(str(e) for e in expected))
+assert_equal(str(render_many(Template(Li(Slot(0))), [("a",), [Span("b")], (b"<i>c</i>",)])), "<li>a</li>\n<li><span>b</span></li>\n<li><i>c</i></li>")
+assert_equal(str(render_many(row, [])), "")
+try:
+    render_many(row, [{"name": "missing slots"}])
+    assert False, "expected KeyError"
+except KeyError:
+    pass
+# Multi-line values are indented like children rendered in the slot's place
+for indent in (2, 4, 0, -1):
+    fasttag.set_indent(indent)
+    layouts = [lambda v: Div(P("t"), v), lambda v: Ul(Li(B("x"), v), Li("y")), lambda v: Div(Pre(v), P()),
+               lambda v: Div(P(), Pre("x\n   ", v))]
+    for layout in layouts:
+        for value in ["a\nb", "a & b\n\nc", Ul(Li("a"), Li("b")), b"<i>\n</i>"]:
+            assert_equal(render_many(Template(layout(Slot(0))), [(value,)]), layout(value))
+fasttag.set_indent(2)
+
+from array import array
+names = ["a & b", "", "<x>"]
+columns = [array("q", [1, -2, 2 ** 63 - 1]), array("d", [1.5, 1e300, 0.1]), memoryview(bytes([1, 0, 1])).cast("?"),
+           (array("i", [0, 5, 5, 8]), "".join(names).encode())]
+cells = zip(columns[0], columns[1], columns[2], names)
+assert_equal(render_table(columns, headers=["n", "x & y", "b", "name"]),
+             Table(Thead(Tr(Th("n"), Th("x & y"), Th("b"), Th("name"))),
+                   Tbody(*[Tr(Td(i), Td(f), Td(bool(b)), Td(n)) for i, f, b, n in cells])))
+assert_equal(render_table([array("q")]), Table(Tbody()))
+for bad in ([], [array("f", [1.0])], [array("q", [1]), array("q")], [(array("i", [0, 9]), b"ab")]):
+    try:
+        render_table(bad)
+        assert False, "expected an error"
+    except (TypeError, ValueError):
+        pass
+
+builder = Builder()
+builder.open("div", _class="list").open("ul")
+for item in ["a & b", 1.5]:
+    builder.open("li").text(item).close()
+builder.open("li").text("x").raw(Span("y")).close()
+builder.close().text("end").close()
+assert_equal(builder.build(), Div(Ul(Li("a & b"), Li(1.5), Li("x", Span("y"))), "end", _class="list"))
+assert_equal(str(builder.open("pre").text("a\nb").close().build()), str(Pre("a\nb")))
+assert_equal(str(builder.build()), "")
+
+# The Builder lays out elements like nested tag calls, at every indentation
+import random
+def random_tree(rng, depth):
+    children = []
+    for _ in range(rng.randrange(4)):
+        kind = rng.randrange(5)
+        if kind == 0 and depth < 3:
+            children.append(random_tree(rng, depth + 1))
+        elif kind == 1:
+            children.append(rng.choice([7, 2.5, -1]))
+        elif kind == 2:
+            children.append(Span("raw"))
+        else:
+            children.append(rng.choice(["a", "b & c", "x\ny", "\n"]))
+    return (rng.choice(["div", "p", "pre", "ul"]), children)
+def call_tree(tree):
+    tag, children = tree
+    return {"div": Div, "p": P, "pre": Pre, "ul": Ul}[tag](*[call_tree(c) if isinstance(c, tuple) else c for c in children])
+def build_tree(builder, tree):
+    tag, children = tree
+    builder.open(tag)
+    for child in children:
+        if isinstance(child, tuple):
+            build_tree(builder, child)
+        elif isinstance(child, HTML):
+            builder.raw(child)
+        else:
+            builder.text(child)
+    builder.close()
+rng = random.Random(43)
+trees = [("div", ["a", "b", "x\ny"]), ("pre", ["a", "b", "c"]), ("div", [("p", ["a"]), 1, "b", 2.5])]
+trees += [random_tree(rng, 0) for _ in range(300)]
+for indent in (2, 0, -1, 3):
+    fasttag.set_indent(indent)
+    builder = Builder()
+    for tree in trees:
+        build_tree(builder, tree)
+        assert_equal(str(builder.build()), str(call_tree(tree)))
+fasttag.set_indent(2)
+builder = Builder()
+builder.open("div")
+try:
+    builder.build()
+    assert False, "expected ValueError"
+except ValueError:
+    pass
+
+# The C API, called through ctypes the way an extension calls it from C
+import ctypes
+assert os.path.exists(os.path.join(fasttag.get_include(), "capi.h"))
+get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+get_pointer.restype, get_pointer.argtypes = ctypes.c_void_p, [ctypes.py_object, ctypes.c_char_p]
+
+class Attr(ctypes.Structure):
+    _fields_ = [("name", ctypes.c_char_p), ("name_length", ctypes.c_size_t), ("kind", ctypes.c_int),
+                ("string", ctypes.c_char_p), ("string_length", ctypes.c_size_t),
+                ("long_value", ctypes.c_longlong), ("double_value", ctypes.c_double)]
+
+class CTag(ctypes.Structure):
+    _fields_ = [("name", ctypes.c_char_p), ("attrs", ctypes.POINTER(Attr)), ("num_attrs", ctypes.c_size_t)]
+
+class CAPI(ctypes.Structure):
+    _fields_ = [("version", ctypes.c_int),
+                ("render_tag", ctypes.PYFUNCTYPE(ctypes.py_object, ctypes.c_void_p, ctypes.POINTER(CTag),
+                                                 ctypes.POINTER(ctypes.py_object), ctypes.c_ssize_t)),
+                ("html_from_string", ctypes.PYFUNCTYPE(ctypes.py_object, ctypes.c_void_p, ctypes.c_char_p,
+                                                       ctypes.c_ssize_t)),
+                ("append_text", ctypes.PYFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.POINTER(ctypes.py_object),
+                                                  ctypes.c_char_p, ctypes.c_ssize_t)),
+                ("html_data", ctypes.PYFUNCTYPE(ctypes.c_void_p, ctypes.c_void_p, ctypes.py_object,
+                                                ctypes.POINTER(ctypes.c_ssize_t)))]
+
+api_pointer = get_pointer(fasttag._fasttag._C_API, b"fasttag._fasttag._C_API")
+api = CAPI.from_address(api_pointer)
+assert api.version >= 1
+attrs = (Attr * 3)(Attr(b"_class", 6, 0, b"a & b", 5), Attr(b"data_n", 6, 1, long_value=-3), Attr(b"hidden", 6, 4))
+children = (ctypes.py_object * 2)("x < y", Span("z"))
+assert_equal(api.render_tag(api_pointer, CTag(b"td", attrs, 3), children, 2),
+             Td("x < y", Span("z"), _class="a & b", data_n=-3, hidden=False))
+assert_equal(api.render_tag(api_pointer, CTag(b"my-tag", None, 0), children, 0), tag("my-tag"))
+html = ctypes.py_object(api.html_from_string(api_pointer, b"<b>", 3))
+shared = html.value
+assert api.append_text(api_pointer, ctypes.byref(html), b"1 < 2", 5) == 0
+assert_equal(str(html.value), "<b>1 &lt; 2")
+assert_equal(str(shared), "<b>")
+size = ctypes.c_ssize_t()
+assert_equal(ctypes.string_at(api.html_data(api_pointer, html.value, ctypes.byref(size)), size.value), b"<b>1 &lt; 2")
+# prepend_raw writes in front of the body, which isn't copied
+body = fasttag.framed("span", "x", headroom=16)
+framed = body.prepend_raw(b"H: 1\r\n\r\n")
+assert_equal(api.html_data(api_pointer, framed, ctypes.byref(size)) + 8, api.html_data(api_pointer, body, ctypes.byref(size)))
 
 
 print(